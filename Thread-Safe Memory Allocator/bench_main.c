@@ -0,0 +1,1332 @@
+
+// Allocator micro-benchmarks.
+//
+// Each mode stresses one aspect of an allocator through the xmalloc
+// interface, so the same program can be linked against sys, hw7 and
+// par like the Collatz programs.
+//
+//  - heap GIB: fill GIB gibibytes with small cells linked in a random
+//    order, then chase the links. Dominated by dTLB misses, so run it
+//    under "perf stat -e dTLB-load-misses".
+//  - burst COUNT ROUNDS: allocate COUNT small objects and free them
+//    all again, ROUNDS times. Shows the cost of giving pages back to
+//    the OS between bursts.
+//  - threads N OPS: N threads each do OPS random allocations and
+//    frees of small objects. Use N well above the core count to see
+//    how per-thread state scales.
+//  - spawn N: start N short-lived threads one after another, each of
+//    which allocates a few objects and exits. Measures what a new
+//    thread pays before its first allocation returns.
+//  - trim COUNT: allocate COUNT small objects, free most of them,
+//    and report RSS before and after opt_trim (par only).
+//  - guard overflow|uaf|double: make the mistake on every one of
+//    many small objects until a guarded one catches it. Run with
+//    OPT_MALLOC_GUARD_RATE set; it is meant to crash (par only).
+//    guard zero allocates and frees zero-byte objects, and reallocs
+//    NULL, instead, which must not be mistaken for a mistake. guard
+//    edge frees a pointer just past the last guarded object, which
+//    must be reported as an invalid free.
+//  - walk N OPS: N threads churn like "threads" while the main thread
+//    walks the heap with opt_heap_walk over and over, then prints the
+//    fragmentation report (par only).
+//  - list COUNT: build a COUNT-cell list with cons while other cells
+//    of the same size come and go around it, then time traversals
+//    of it. Runs once with plain cons and once with cells placed
+//    next to their successor through opt_malloc_near (par only).
+//  - deferred N OPS: N threads read objects out of a shared table
+//    inside epoch critical sections while replacing one in ten and
+//    retiring the old one with opt_free_deferred. Checks that no
+//    object is reused while it can still be read (par only).
+//  - pc PAIRS OPS: PAIRS producer threads each allocate OPS objects
+//    and pass them through a ring to their own consumer thread,
+//    which frees them. Every free is a cross-thread free; run it under
+//    "perf c2c" (make c2c) to count cache-line transfers.
+//  - exitfree: a thread frees objects from another thread's arena in
+//    a TLS destructor that runs after the allocator's own, and checks
+//    that they still get back to their bins (par only).
+//  - frag OPS: a long-running mixed workload of OPS random
+//    allocations and frees of 8 to 3072 bytes whose live set grows
+//    and shrinks in phases, ending on a shrink. Reports live bytes
+//    against RSS to show how much memory fragmentation holds on to.
+//  - mem DIST LIFE OPS: OPS allocations and frees with sizes drawn
+//    from DIST (small, pow2, ivec or tail) and lifetimes following
+//    LIFE (steady, phases or fifo). Samples bytes requested against
+//    bytes mapped and RSS from /proc/self/smaps_rollup as it goes and
+//    ends with the peak overheads; "make memory" runs every
+//    combination on every backend.
+//  - ctl COUNT: allocate and free COUNT 256 KiB objects with the large
+//    extent cache as configured, then again after opt_mallctl turns it
+//    off, to show the cost of unmapping every large free (par only).
+//  - persist build|crash|load PATH COUNT: build a hash table of COUNT
+//    entries in a persistent heap file and close it, or exit without
+//    closing it; or open the file again and check every entry. Shows
+//    what a restart costs against rebuilding the table with xmalloc
+//    (par only; "make persist" runs all three).
+//  - share PROCS OPS: fork PROCS processes around a shared heap. Each
+//    allocates OPS objects there and passes them by offset through a
+//    ring to the next process, which checks and frees them. Then
+//    workers are killed mid-loop to show the heap recovering from a
+//    process that died holding its lock, and checks that freeing a
+//    large object twice aborts (par only).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "xmalloc.h"
+#include "list.h"
+#include "bin_t.h"
+#include "pheap_t.h"
+
+// Only the par allocator has stats to report and memory to trim. A binary
+// linked with every backend has these too, so check which one is in use.
+void opt_printstats() __attribute__((weak));
+size_t opt_trim(size_t pad) __attribute__((weak));
+void* opt_malloc_near(size_t bytes, void* hint) __attribute__((weak));
+void opt_epoch_enter() __attribute__((weak));
+void opt_epoch_exit() __attribute__((weak));
+void opt_free_deferred(void* item) __attribute__((weak));
+void opt_heap_walk(void (*fn)(const heap_class*, void*), void* arg) __attribute__((weak));
+void opt_heap_report() __attribute__((weak));
+int opt_mallctl(const char* name, void* oldp, size_t* oldlenp, void* newp, size_t newlen)
+    __attribute__((weak));
+pheap* pheap_open(const char* path, size_t size) __attribute__((weak));
+pheap* pheap_share(size_t size) __attribute__((weak));
+void pheap_close(pheap* heap) __attribute__((weak));
+void* pheap_alloc(pheap* heap, size_t bytes) __attribute__((weak));
+void pheap_free(pheap* heap, void* item) __attribute__((weak));
+void* pheap_root(pheap* heap) __attribute__((weak));
+void pheap_set_root(pheap* heap, void* item) __attribute__((weak));
+void hprintstats() __attribute__((weak));
+
+typedef struct node {
+    struct node* next;
+    long         pad[5];
+} node;
+
+double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+long
+rss_kb()
+{
+    long pages = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%*s %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(fp);
+    }
+    return pages * 4;
+}
+
+int
+par_active()
+{
+    return opt_printstats && strcmp(xmalloc_backend_name(), "par") == 0;
+}
+
+void
+print_stats()
+{
+    if (par_active()) {
+        opt_printstats();
+    }
+    else if (hprintstats && strcmp(xmalloc_backend_name(), "hw7") == 0) {
+        hprintstats();
+    }
+}
+
+int
+bench_heap(double gib)
+{
+    long count = (long) (gib * (1L << 30) / sizeof(node));
+    node** nodes = xmalloc(count * sizeof(node*));
+
+    double t0 = now();
+    for (long ii = 0; ii < count; ++ii) {
+        nodes[ii] = xmalloc(sizeof(node));
+    }
+    double t1 = now();
+
+    // Link the cells into one cycle in a random order.
+    for (long ii = count - 1; ii > 0; --ii) {
+        long jj = random() % (ii + 1);
+        node* tmp = nodes[ii];
+        nodes[ii] = nodes[jj];
+        nodes[jj] = tmp;
+    }
+    for (long ii = 0; ii < count; ++ii) {
+        nodes[ii]->next = nodes[(ii + 1) % count];
+    }
+
+    double t2 = now();
+    node* cur = nodes[0];
+    for (long ii = 0; ii < count; ++ii) {
+        cur = cur->next;
+    }
+    double t3 = now();
+
+    printf("heap: %ld cells, alloc %.3fs, chase %.3fs (%.1f ns/hop) end=%p\n",
+           count, t1 - t0, t3 - t2, (t3 - t2) * 1e9 / count, (void*) cur);
+    print_stats();
+
+    // The cells are left for exit to reclaim; only the chase is measured.
+    xfree(nodes);
+    return 0;
+}
+
+int
+bench_burst(long count, long rounds)
+{
+    void** objs = xmalloc(count * sizeof(void*));
+
+    double t0 = now();
+    for (long rr = 0; rr < rounds; ++rr) {
+        for (long ii = 0; ii < count; ++ii) {
+            objs[ii] = xmalloc(16 + (ii % 4) * 16);
+            *((long*) objs[ii]) = ii;
+        }
+        for (long ii = count - 1; ii >= 0; --ii) {
+            xfree(objs[ii]);
+        }
+    }
+    double t1 = now();
+
+    printf("burst: %ld x %ld objects in %.3fs (%.1f ns/op)\n",
+           rounds, count, t1 - t0, (t1 - t0) * 1e9 / (2 * rounds * count));
+    print_stats();
+
+    xfree(objs);
+    return 0;
+}
+
+int
+bench_trim(long count)
+{
+    void** objs = xmalloc(count * sizeof(void*));
+    for (long ii = 0; ii < count; ++ii) {
+        objs[ii] = xmalloc(64 + (ii % 8) * 64);
+        memset(objs[ii], 1, 64);
+    }
+    // Keep every 64th object so most pages stay partly used
+    for (long ii = count - 1; ii >= 0; --ii) {
+        if (ii % 64 != 0) {
+            xfree(objs[ii]);
+        }
+    }
+    long before = rss_kb();
+
+    double t0 = now();
+    size_t bytes = par_active() ? opt_trim(0) : 0;
+    double t1 = now();
+
+    printf("trim: %zu bytes given back in %.3fs, RSS %ld kB -> %ld kB\n",
+           bytes, t1 - t0, before, rss_kb());
+    print_stats();
+
+    for (long ii = 0; ii < count; ii += 64) {
+        xfree(objs[ii]);
+    }
+    xfree(objs);
+    return 0;
+}
+
+int
+bench_frag(long ops)
+{
+    long nslots = 100000;
+    void** slots = xmalloc(nslots * sizeof(void*));
+    size_t* sizes = xmalloc(nslots * sizeof(size_t));
+    memset(slots, 0, nslots * sizeof(void*));
+    unsigned int seed = 1;
+    size_t live = 0;
+
+    double t0 = now();
+    for (long ii = 0; ii < ops; ++ii) {
+        // Grow to about 80% of the slots, then shrink to about 10%, twice over
+        int grow = (ii / (ops / 4)) % 2 == 0;
+        long jj = rand_r(&seed) % nslots;
+        int roll = rand_r(&seed) % 100;
+        if (slots[jj] && roll < (grow ? 20 : 100)) {
+            xfree(slots[jj]);
+            slots[jj] = 0;
+            live -= sizes[jj];
+        }
+        else if (!slots[jj] && roll < (grow ? 100 : 10)) {
+            // Mostly small objects with a tail of larger ones
+            if (rand_r(&seed) % 100 < 80) {
+                sizes[jj] = 8 + rand_r(&seed) % 248;
+            }
+            else {
+                sizes[jj] = 256 + rand_r(&seed) % 2817;
+            }
+            slots[jj] = xmalloc(sizes[jj]);
+            memset(slots[jj], 1, 8);
+            live += sizes[jj];
+        }
+    }
+    double t1 = now();
+
+    printf("frag: %ld ops in %.3fs (%.1f ns/op), live %zu kB, RSS %ld kB\n",
+           ops, t1 - t0, (t1 - t0) * 1e9 / ops, live / 1024, rss_kb());
+    print_stats();
+
+    for (long jj = 0; jj < nslots; ++jj) {
+        if (slots[jj]) {
+            xfree(slots[jj]);
+        }
+    }
+    xfree(sizes);
+    xfree(slots);
+    return 0;
+}
+
+// Reads a field such as "Rss:" from /proc/self/smaps_rollup, in kB
+long
+smaps_kb(const char* field)
+{
+    long kb = 0;
+    char line[256];
+    FILE* fp = fopen("/proc/self/smaps_rollup", "r");
+    if (!fp) {
+        return rss_kb();
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, field, strlen(field)) == 0) {
+            kb = atol(line + strlen(field));
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+long
+mapped_kb()
+{
+    long pages = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        if (fscanf(fp, "%ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(fp);
+    }
+    return pages * 4;
+}
+
+enum { DIST_SMALL, DIST_POW2, DIST_IVEC, DIST_TAIL };
+enum { LIFE_STEADY, LIFE_PHASES, LIFE_FIFO };
+
+size_t
+mem_size(int dist, unsigned int* seed)
+{
+    int roll = rand_r(seed) % 1000;
+    switch (dist) {
+    case DIST_SMALL:
+        return 8 + rand_r(seed) % 249;
+    case DIST_POW2:
+        return (size_t) 8 << (rand_r(seed) % 10);
+    case DIST_IVEC:
+        // The final size; the object gets there by doubling from 16 bytes
+        return (size_t) 16 << (rand_r(seed) % 9);
+    default:
+        // Mostly small, some kilobytes, and a few objects big enough to be mapped on their own
+        if (roll < 900) {
+            return 16 + rand_r(seed) % 113;
+        }
+        if (roll < 998) {
+            return 1024 + rand_r(seed) % 15361;
+        }
+        return 65536 + rand_r(seed) % 196609;
+    }
+}
+
+int
+bench_mem(int dist, int life, const char* name, long ops)
+{
+    long nslots = 20000;
+    void** slots = xmalloc(nslots * sizeof(void*));
+    size_t* sizes = xmalloc(nslots * sizeof(size_t));
+    memset(slots, 0, nslots * sizeof(void*));
+    unsigned int seed = 1;
+    size_t requested = 0;
+    long base_rss = smaps_kb("Rss:");
+    long base_mapped = mapped_kb();
+
+    size_t peak_requested = 0;
+    long peak_rss = 0;
+    long peak_mapped = 0;
+    double worst = 0;
+    long sample_every = ops / 50 > 0 ? ops / 50 : 1;
+    printf("%8s %8s %10s %10s %10s %8s\n", "ms", "ops", "req kB", "mapped kB", "RSS kB",
+           "RSS/req");
+
+    double t0 = now();
+    for (long ii = 0; ii < ops; ++ii) {
+        long jj = life == LIFE_FIFO ? ii % nslots : rand_r(&seed) % nslots;
+        int roll = rand_r(&seed) % 100;
+        // Phases grow to most of the slots and shrink again, twice over, ending on a shrink
+        int grow = (ii / (ops / 4 > 0 ? ops / 4 : 1)) % 2 == 0;
+        int free_it;
+        if (life == LIFE_FIFO) {
+            free_it = 1;
+        }
+        else if (life == LIFE_PHASES) {
+            free_it = roll < (grow ? 20 : 100);
+        }
+        else {
+            free_it = roll < 50;
+        }
+
+        if (slots[jj] && free_it) {
+            xfree(slots[jj]);
+            slots[jj] = 0;
+            requested -= sizes[jj];
+        }
+        if (!slots[jj] && (life != LIFE_PHASES || roll < (grow ? 100 : 10))) {
+            sizes[jj] = mem_size(dist, &seed);
+            if (dist == DIST_IVEC) {
+                // Grown one push at a time, like an ivec
+                size_t cap = 16;
+                slots[jj] = xmalloc(cap);
+                memset(slots[jj], 1, cap);
+                for (; cap < sizes[jj]; cap *= 2) {
+                    slots[jj] = xrealloc(slots[jj], 2 * cap);
+                    memset((char*) slots[jj] + cap, 1, cap);
+                }
+            }
+            else {
+                slots[jj] = xmalloc(sizes[jj]);
+                memset(slots[jj], 1, sizes[jj]);
+            }
+            requested += sizes[jj];
+        }
+
+        if ((ii + 1) % sample_every == 0) {
+            long rss = smaps_kb("Rss:") - base_rss;
+            long mapped = mapped_kb() - base_mapped;
+            double ratio = requested > 0 ? rss * 1024.0 / requested : 0;
+            printf("%8.1f %8ld %10zu %10ld %10ld %8.2f\n", (now() - t0) * 1e3, ii + 1,
+                   requested / 1024, mapped, rss, ratio);
+            if (requested > peak_requested) {
+                peak_requested = requested;
+            }
+            if (rss > peak_rss) {
+                peak_rss = rss;
+            }
+            if (mapped > peak_mapped) {
+                peak_mapped = mapped;
+            }
+            // Below a megabyte the ratio says more about the baseline than the allocator
+            if (requested >= 1 << 20 && ratio > worst) {
+                worst = ratio;
+            }
+        }
+    }
+    double t1 = now();
+
+    printf("mem: %s %s: %.3fs, peak %zu kB requested, %ld kB mapped, %ld kB RSS; "
+           "peak RSS/requested %.2f, worst sample %.2f\n",
+           xmalloc_backend_name(), name, t1 - t0, peak_requested / 1024, peak_mapped, peak_rss,
+           peak_requested > 0 ? peak_rss * 1024.0 / peak_requested : 0, worst);
+    print_stats();
+
+    for (long jj = 0; jj < nslots; ++jj) {
+        if (slots[jj]) {
+            xfree(slots[jj]);
+        }
+    }
+    xfree(sizes);
+    xfree(slots);
+    return 0;
+}
+
+cell*
+cons_near(long item, cell* rest)
+{
+    cell* xs = opt_malloc_near(sizeof(cell), rest);
+    xs->item = item;
+    xs->rest = rest;
+    return xs;
+}
+
+double
+build_and_walk(long count, int hinted)
+{
+    // Surround the list with a churning population of cells of the same size
+    long nslots = 2 * count;
+    cell** slots = xmalloc(nslots * sizeof(cell*));
+    unsigned int seed = 1;
+    for (long jj = 0; jj < nslots; ++jj) {
+        slots[jj] = cons(jj, 0);
+    }
+    for (long jj = 0; jj < nslots; jj += 2) {
+        xfree(slots[jj]);
+        slots[jj] = 0;
+    }
+
+    cell* xs = 0;
+    for (long ii = 0; ii < count; ++ii) {
+        xs = hinted ? cons_near(ii, xs) : cons(ii, xs);
+        for (int kk = 0; kk < 2; ++kk) {
+            long jj = rand_r(&seed) % nslots;
+            if (slots[jj]) {
+                xfree(slots[jj]);
+                slots[jj] = 0;
+            }
+            else {
+                slots[jj] = cons(jj, 0);
+            }
+        }
+    }
+
+    long walks = 10;
+    long total = 0;
+    double t0 = now();
+    for (long ww = 0; ww < walks; ++ww) {
+        total += count_list(xs);
+    }
+    double t1 = now();
+    assert(total == walks * count);
+
+    free_list(xs);
+    for (long jj = 0; jj < nslots; ++jj) {
+        if (slots[jj]) {
+            xfree(slots[jj]);
+        }
+    }
+    xfree(slots);
+    return (t1 - t0) * 1e9 / total;
+}
+
+int
+bench_list(long count)
+{
+    double plain = build_and_walk(count, 0);
+    printf("list: %ld cells, cons %.2f ns/hop", count, plain);
+    if (par_active()) {
+        double near = build_and_walk(count, 1);
+        printf(", cons near %.2f ns/hop", near);
+    }
+    printf("\n");
+    return 0;
+}
+
+long thread_ops = 0;
+// Threads that have finished their churn, for bench_walk
+int done_threads = 0;
+
+#define RING_SIZE 1024
+
+typedef struct ring {
+    void* items[RING_SIZE];
+    long  head __attribute__((aligned(64)));
+    long  tail __attribute__((aligned(64)));
+} ring;
+
+void*
+producer(void* arg)
+{
+    ring* rr = arg;
+    for (long ii = 0; ii < thread_ops; ++ii) {
+        long* obj = xmalloc(64);
+        obj[0] = ii;
+        long tail = rr->tail;
+        while (tail - __atomic_load_n(&rr->head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+            sched_yield();
+        }
+        rr->items[tail % RING_SIZE] = obj;
+        __atomic_store_n(&rr->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+void*
+consumer(void* arg)
+{
+    ring* rr = arg;
+    for (long ii = 0; ii < thread_ops; ++ii) {
+        long head = rr->head;
+        while (__atomic_load_n(&rr->tail, __ATOMIC_ACQUIRE) == head) {
+            sched_yield();
+        }
+        long* obj = rr->items[head % RING_SIZE];
+        __atomic_store_n(&rr->head, head + 1, __ATOMIC_RELEASE);
+        assert(obj[0] == ii);
+        xfree(obj);
+    }
+    return 0;
+}
+
+int
+bench_pc(int pairs, long ops)
+{
+    pthread_t* threads = xmalloc(2 * pairs * sizeof(pthread_t));
+    ring* rings = xmalloc(pairs * sizeof(ring));
+    memset(rings, 0, pairs * sizeof(ring));
+    thread_ops = ops;
+
+    double t0 = now();
+    for (long ii = 0; ii < pairs; ++ii) {
+        int rv = pthread_create(&(threads[2 * ii]), 0, producer, &rings[ii]);
+        assert(rv == 0);
+        rv = pthread_create(&(threads[2 * ii + 1]), 0, consumer, &rings[ii]);
+        assert(rv == 0);
+    }
+    for (int ii = 0; ii < 2 * pairs; ++ii) {
+        int rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+    double t1 = now();
+
+    printf("pc: %d pairs x %ld objects in %.3fs (%.2f Mobjs/s), RSS %ld kB\n",
+           pairs, ops, t1 - t0, pairs * ops / (t1 - t0) / 1e6, rss_kb());
+    print_stats();
+
+    xfree(rings);
+    xfree(threads);
+    return 0;
+}
+
+#define SHARED_SLOTS 64
+#define LIVE_MAGIC 0x5afe5afe
+
+typedef struct shared_obj {
+    long magic;
+    long value;
+    long pad[2];
+} shared_obj;
+
+shared_obj* shared[SHARED_SLOTS];
+
+shared_obj*
+new_shared(long value)
+{
+    shared_obj* obj = xmalloc(sizeof(shared_obj));
+    obj->magic = LIVE_MAGIC;
+    obj->value = value;
+    return obj;
+}
+
+void*
+reader_writer(void* arg)
+{
+    unsigned int seed = (unsigned int) (long) arg;
+    for (long ii = 0; ii < thread_ops; ++ii) {
+        int jj = rand_r(&seed) % SHARED_SLOTS;
+        opt_epoch_enter();
+        shared_obj* obj = __atomic_load_n(&shared[jj], __ATOMIC_ACQUIRE);
+        assert(obj->magic == LIVE_MAGIC);
+        shared_obj* old = 0;
+        if (rand_r(&seed) % 10 == 0) {
+            old = __atomic_exchange_n(&shared[jj], new_shared(ii), __ATOMIC_ACQ_REL);
+        }
+        opt_epoch_exit();
+        opt_free_deferred(old);
+
+        // Reuse freed chunks of the same size right away, so early reuse would be caught
+        shared_obj* junk = xmalloc(sizeof(shared_obj));
+        junk->magic = 0;
+        xfree(junk);
+    }
+    return 0;
+}
+
+int
+bench_deferred(int nthreads, long ops)
+{
+    if (!par_active()) {
+        printf("deferred: not supported by this allocator\n");
+        return 0;
+    }
+    pthread_t* threads = xmalloc(nthreads * sizeof(pthread_t));
+    thread_ops = ops;
+    for (int jj = 0; jj < SHARED_SLOTS; ++jj) {
+        shared[jj] = new_shared(jj);
+    }
+
+    double t0 = now();
+    for (long ii = 0; ii < nthreads; ++ii) {
+        int rv = pthread_create(&(threads[ii]), 0, reader_writer, (void*) ii);
+        assert(rv == 0);
+    }
+    for (int ii = 0; ii < nthreads; ++ii) {
+        int rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+    double t1 = now();
+
+    // The exited threads left their last batches behind; a trim frees them
+    opt_trim(0);
+    printf("deferred: %d x %ld ops in %.3fs (%.2f Mops/s), RSS %ld kB\n",
+           nthreads, ops, t1 - t0, nthreads * ops / (t1 - t0) / 1e6, rss_kb());
+    print_stats();
+
+    for (int jj = 0; jj < SHARED_SLOTS; ++jj) {
+        xfree(shared[jj]);
+    }
+    xfree(threads);
+    return 0;
+}
+
+void*
+churn(void* arg)
+{
+    void* slots[64] = {0};
+    unsigned int seed = (unsigned int) (long) arg;
+    for (long ii = 0; ii < thread_ops; ++ii) {
+        int jj = rand_r(&seed) % 64;
+        if (slots[jj]) {
+            xfree(slots[jj]);
+            slots[jj] = 0;
+        }
+        else {
+            slots[jj] = xmalloc(8 + rand_r(&seed) % 504);
+            *((long*) slots[jj]) = ii;
+        }
+    }
+    for (int jj = 0; jj < 64; ++jj) {
+        if (slots[jj]) {
+            xfree(slots[jj]);
+        }
+    }
+    __atomic_add_fetch(&done_threads, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void*
+short_task(void* arg)
+{
+    void* objs[8];
+    for (int ii = 0; ii < 8; ++ii) {
+        objs[ii] = xmalloc(16 << ii);
+        *((long*) objs[ii]) = ii;
+    }
+    for (int ii = 0; ii < 8; ++ii) {
+        xfree(objs[ii]);
+    }
+    return 0;
+}
+
+int
+bench_spawn(long count)
+{
+    double t0 = now();
+    for (long ii = 0; ii < count; ++ii) {
+        pthread_t thread;
+        int rv = pthread_create(&thread, 0, short_task, 0);
+        assert(rv == 0);
+        rv = pthread_join(thread, 0);
+        assert(rv == 0);
+    }
+    double t1 = now();
+
+    printf("spawn: %ld threads in %.3fs (%.1f us/thread), RSS %ld kB\n",
+           count, t1 - t0, (t1 - t0) * 1e6 / count, rss_kb());
+    print_stats();
+    return 0;
+}
+
+int
+bench_threads(int nthreads, long ops)
+{
+    pthread_t* threads = xmalloc(nthreads * sizeof(pthread_t));
+    thread_ops = ops;
+
+    double t0 = now();
+    for (long ii = 0; ii < nthreads; ++ii) {
+        int rv = pthread_create(&(threads[ii]), 0, churn, (void*) ii);
+        assert(rv == 0);
+    }
+    for (int ii = 0; ii < nthreads; ++ii) {
+        int rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+    double t1 = now();
+
+    printf("threads: %d x %ld ops in %.3fs (%.2f Mops/s), RSS %ld kB\n",
+           nthreads, ops, t1 - t0, nthreads * ops / (t1 - t0) / 1e6, rss_kb());
+    print_stats();
+
+    xfree(threads);
+    return 0;
+}
+
+int
+bench_guard(const char* kind)
+{
+    if (!par_active()) {
+        printf("guard: not supported by this allocator\n");
+        return 0;
+    }
+    if (strcmp(kind, "zero") == 0) {
+        for (long ii = 0; ii < 100000; ++ii) {
+            xfree(xmalloc(0));
+            xfree(xrealloc(0, 24));
+        }
+        printf("guard: zero-byte objects and reallocs of NULL freed cleanly\n");
+        return 0;
+    }
+    if (strcmp(kind, "edge") == 0) {
+        // With one slot, the second object is in it, and the end of its page is the guard page
+        // at the end of the pool
+        xmalloc(24);
+        char* obj = xmalloc(24);
+        xfree(obj + 24);
+        printf("guard: nothing caught\n");
+        return 1;
+    }
+    for (long ii = 0; ii < 1000000; ++ii) {
+        volatile char* obj = xmalloc(24);
+        if (strcmp(kind, "overflow") == 0) {
+            obj[24] = 1;
+            xfree((void*) obj);
+        }
+        else if (strcmp(kind, "uaf") == 0) {
+            xfree((void*) obj);
+            obj[0] = 1;
+        }
+        else {
+            xfree((void*) obj);
+            // Only a guarded object is checked; the next one put in its place hides the rest
+            xfree((void*) obj);
+            xmalloc(24);
+        }
+    }
+    printf("guard: nothing caught\n");
+    return 1;
+}
+
+void
+count_live(const heap_class* hc, void* arg)
+{
+    *((long*) arg) += hc->live_chunks;
+}
+
+int
+bench_walk(int nthreads, long ops)
+{
+    if (!par_active()) {
+        printf("walk: not supported by this allocator\n");
+        return 0;
+    }
+    pthread_t* threads = xmalloc(nthreads * sizeof(pthread_t));
+    thread_ops = ops;
+    done_threads = 0;
+
+    double t0 = now();
+    for (long ii = 0; ii < nthreads; ++ii) {
+        int rv = pthread_create(&(threads[ii]), 0, churn, (void*) ii);
+        assert(rv == 0);
+    }
+    long walks = 0;
+    long max_live = 0;
+    while (__atomic_load_n(&done_threads, __ATOMIC_ACQUIRE) < nthreads) {
+        long live = 0;
+        opt_heap_walk(count_live, &live);
+        if (live > max_live) {
+            max_live = live;
+        }
+        walks += 1;
+        sched_yield();
+    }
+    for (int ii = 0; ii < nthreads; ++ii) {
+        int rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+    double t1 = now();
+
+    printf("walk: %d x %ld ops in %.3fs, %ld walks, at most %ld live chunks\n",
+           nthreads, ops, t1 - t0, walks, max_live);
+    opt_heap_report();
+
+    xfree(threads);
+    return 0;
+}
+
+#define EXIT_OBJECTS 8
+
+void* exit_objects[EXIT_OBJECTS];
+pthread_key_t exit_key;
+
+void
+free_at_exit(void* arg)
+{
+    (void) arg;
+    for (int ii = 1; ii < EXIT_OBJECTS; ++ii) {
+        xfree(exit_objects[ii]);
+    }
+}
+
+void*
+exit_freer(void* arg)
+{
+    (void) arg;
+    // The first free sets up the allocator's own exit handling, so the
+    // rest are freed after it has run
+    xfree(exit_objects[0]);
+    pthread_key_create(&exit_key, free_at_exit);
+    pthread_setspecific(exit_key, exit_objects);
+    return 0;
+}
+
+int
+bench_exitfree()
+{
+    if (!par_active()) {
+        printf("exitfree: not supported by this allocator\n");
+        return 0;
+    }
+    long before = 0;
+    opt_heap_walk(count_live, &before);
+    for (int ii = 0; ii < EXIT_OBJECTS; ++ii) {
+        exit_objects[ii] = xmalloc(40);
+    }
+    pthread_t thread;
+    int rv = pthread_create(&thread, 0, exit_freer, 0);
+    assert(rv == 0);
+    rv = pthread_join(thread, 0);
+    assert(rv == 0);
+
+    // Taking back what other threads freed happens on the next allocation
+    xfree(xmalloc(40));
+    long after = 0;
+    opt_heap_walk(count_live, &after);
+    printf("exitfree: %ld of %d objects freed during thread exit are still live\n",
+           after - before, EXIT_OBJECTS);
+    return after == before ? 0 : 1;
+}
+
+double
+large_churn(long count)
+{
+    double t0 = now();
+    for (long ii = 0; ii < count; ++ii) {
+        char* obj = xmalloc(256 * 1024);
+        obj[ii % (256 * 1024)] = 1;
+        xfree(obj);
+    }
+    return now() - t0;
+}
+
+int
+bench_ctl(long count)
+{
+    if (!par_active()) {
+        printf("ctl: not supported by this allocator\n");
+        return 0;
+    }
+    long cached;
+    size_t len = sizeof(cached);
+    int rv = opt_mallctl("large_cached", &cached, &len, 0, 0);
+    assert(rv == 0);
+    printf("ctl: large_cached:%ld, %ld large frees in %.3fs\n", cached, count, large_churn(count));
+
+    long off = 0;
+    rv = opt_mallctl("large_cached", 0, 0, &off, sizeof(off));
+    assert(rv == 0);
+    printf("ctl: large_cached:0, %ld large frees in %.3fs\n", count, large_churn(count));
+
+    // Arenas are fixed once the first thread has one, and there is no such setting as bins
+    long arenas = 8;
+    printf("ctl: setting arenas gives %s, reading bins gives %s\n",
+           strerror(opt_mallctl("arenas", 0, 0, &arenas, sizeof(arenas))),
+           strerror(opt_mallctl("bins", &arenas, &len, 0, 0)));
+
+    // A value of the wrong size is refused before it is read
+    char small = 0;
+    rv = opt_mallctl("large_cached", 0, 0, &small, sizeof(small));
+    assert(rv == EINVAL);
+    rv = opt_mallctl("large_cached", 0, 0, &cached, sizeof(cached));
+    assert(rv == 0);
+    return 0;
+}
+
+// A hash table kept in a persistent heap. It links by heap offsets, so
+// it is valid wherever the heap is mapped.
+typedef struct pentry {
+    uint64_t next;
+    long     key;
+    int      len;
+    char     value[];
+} pentry;
+
+typedef struct ptable {
+    long     count;
+    long     nbuckets;
+    uint64_t buckets;
+} ptable;
+
+// Builds the table with the given allocator; heap is 0 for xmalloc
+ptable*
+build_table(pheap* heap, long count)
+{
+    ptable* table = heap ? pheap_alloc(heap, sizeof(ptable)) : xmalloc(sizeof(ptable));
+    table->count = count;
+    table->nbuckets = count;
+    size_t bytes = count * sizeof(uint64_t);
+    uint64_t* buckets = heap ? pheap_alloc(heap, bytes) : xmalloc(bytes);
+    memset(buckets, 0, bytes);
+    table->buckets = heap ? pheap_offset(heap, buckets) : (uint64_t) buckets;
+    unsigned int seed = 1;
+    for (long key = 0; key < count; ++key) {
+        int len = 16 + rand_r(&seed) % 185;
+        pentry* e = heap ? pheap_alloc(heap, sizeof(pentry) + len)
+                         : xmalloc(sizeof(pentry) + len);
+        assert(e != 0);
+        e->key = key;
+        e->len = len;
+        memset(e->value, 'a' + key % 26, len);
+        e->next = buckets[key % count];
+        buckets[key % count] = heap ? pheap_offset(heap, e) : (uint64_t) e;
+    }
+    return table;
+}
+
+int
+bench_persist(const char* how, const char* path, long count)
+{
+    if (!pheap_open) {
+        printf("persist: not supported by this allocator\n");
+        return 0;
+    }
+    if (strcmp(how, "load") != 0) {
+        double t0 = now();
+        ptable* table = build_table(0, count);
+        double t1 = now();
+        printf("persist: built %ld entries with xmalloc in %.3fs\n", count, t1 - t0);
+        uint64_t* buckets = (uint64_t*) table->buckets;
+        for (long ii = 0; ii < count; ++ii) {
+            for (pentry* e = (pentry*) buckets[ii]; e != 0;) {
+                pentry* next = (pentry*) e->next;
+                xfree(e);
+                e = next;
+            }
+        }
+        xfree(buckets);
+        xfree(table);
+
+        unlink(path);
+        t0 = now();
+        pheap* heap = pheap_open(path, (size_t) count * 256 + (64L << 20));
+        if (heap == 0) {
+            perror("persist");
+            return 1;
+        }
+        pheap_set_root(heap, build_table(heap, count));
+        t1 = now();
+        printf("persist: built %ld entries in %s in %.3fs\n", count, path, t1 - t0);
+        if (strcmp(how, "crash") == 0) {
+            printf("persist: exiting without closing the heap\n");
+            fflush(stdout);
+            _exit(0);
+        }
+        pheap_close(heap);
+        printf("persist: closed in %.3fs\n", now() - t1);
+        return 0;
+    }
+
+    double t0 = now();
+    pheap* heap = pheap_open(path, 0);
+    double t1 = now();
+    if (heap == 0) {
+        perror("persist");
+        return 1;
+    }
+    printf("persist: opened %s in %.6fs%s\n", path, t1 - t0,
+           heap->recovered ? ", recovered after a crash" : "");
+    ptable* table = pheap_root(heap);
+    uint64_t* buckets = pheap_pointer(heap, table->buckets);
+    long found = 0;
+    long bad = 0;
+    for (long ii = 0; ii < table->nbuckets; ++ii) {
+        for (pentry* e = pheap_pointer(heap, buckets[ii]); e != 0;
+             e = pheap_pointer(heap, e->next)) {
+            found += 1;
+            bad += e->value[e->len - 1] != 'a' + e->key % 26;
+        }
+    }
+    double t2 = now();
+    printf("persist: checked %ld of %ld entries in %.3fs, %ld bad\n", found, table->count,
+           t2 - t1, bad);
+
+    // Replace one entry in a hundred, to show the heap carries on where it left off
+    for (long ii = 0; ii < table->nbuckets; ii += 100) {
+        pentry* e = pheap_pointer(heap, buckets[ii]);
+        if (e != 0) {
+            pentry* copy = pheap_alloc(heap, sizeof(pentry) + e->len);
+            memcpy(copy, e, sizeof(pentry) + e->len);
+            buckets[ii] = pheap_offset(heap, copy);
+            pheap_free(heap, e);
+        }
+    }
+    int rv = found == table->count && bad == 0 ? 0 : 1;
+    pheap_close(heap);
+    return rv;
+}
+
+#define SHARE_RING 256
+
+// Objects in flight from one process to the next, by heap offset
+typedef struct share_ring {
+    uint64_t head;
+    uint64_t tail;
+    uint64_t items[SHARE_RING];
+} share_ring;
+
+typedef struct share_msg {
+    int  from;
+    long seq;
+    int  len;
+    char data[];
+} share_msg;
+
+// Sends ops objects to the next process and checks the ops objects that
+// come from the one before; returns how many were wrong
+long
+share_worker(pheap* heap, share_ring** rings, int ii, int procs, long ops)
+{
+    share_ring* out = rings[(ii + 1) % procs];
+    share_ring* in = rings[ii];
+    int from = (ii + procs - 1) % procs;
+    unsigned int seed = ii + 1;
+    long sent = 0;
+    long received = 0;
+    long bad = 0;
+    while (sent < ops || received < ops) {
+        int moved = 0;
+        uint64_t tail = out->tail;
+        if (sent < ops && tail - __atomic_load_n(&out->head, __ATOMIC_ACQUIRE) < SHARE_RING) {
+            int len = 1 + rand_r(&seed) % 500;
+            share_msg* msg = pheap_alloc(heap, sizeof(share_msg) + len);
+            msg->from = ii;
+            msg->seq = sent;
+            msg->len = len;
+            memset(msg->data, (int) (sent % 251), len);
+            out->items[tail % SHARE_RING] = pheap_offset(heap, msg);
+            __atomic_store_n(&out->tail, tail + 1, __ATOMIC_RELEASE);
+            sent += 1;
+            moved = 1;
+        }
+        uint64_t head = in->head;
+        if (head != __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE)) {
+            share_msg* msg = pheap_pointer(heap, in->items[head % SHARE_RING]);
+            bad += msg->from != from || msg->seq != received ||
+                   msg->data[msg->len - 1] != (char) (received % 251);
+            pheap_free(heap, msg);
+            __atomic_store_n(&in->head, head + 1, __ATOMIC_RELEASE);
+            received += 1;
+            moved = 1;
+        }
+        if (!moved) {
+            sched_yield();
+        }
+    }
+    return bad;
+}
+
+int
+bench_share(int procs, long ops)
+{
+    if (!pheap_share) {
+        printf("share: not supported by this allocator\n");
+        return 0;
+    }
+    pheap* heap = pheap_share(256L << 20);
+    share_ring** rings = xmalloc(procs * sizeof(share_ring*));
+    for (int ii = 0; ii < procs; ++ii) {
+        rings[ii] = pheap_alloc(heap, sizeof(share_ring));
+        memset(rings[ii], 0, sizeof(share_ring));
+    }
+
+    double t0 = now();
+    for (int ii = 0; ii < procs; ++ii) {
+        if (fork() == 0) {
+            _exit(share_worker(heap, rings, ii, procs, ops) == 0 ? 0 : 1);
+        }
+    }
+    int failed = 0;
+    for (int ii = 0; ii < procs; ++ii) {
+        int status;
+        wait(&status);
+        failed += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    double t1 = now();
+    for (int ii = 0; ii < procs; ++ii) {
+        pheap_free(heap, rings[ii]);
+    }
+    printf("share: %d processes passed %ld objects each in %.3fs, %d saw bad objects, "
+           "%u pages in use after\n", procs, ops, t1 - t0, failed, heap->top - heap->data_start);
+
+    // Kill workers while they allocate; some die holding the heap's lock
+    int rounds = 20;
+    for (int ii = 0; ii < rounds; ++ii) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            void* live[64] = {0};
+            for (unsigned int seed = 1;; ) {
+                int slot = rand_r(&seed) % 64;
+                pheap_free(heap, live[slot]);
+                live[slot] = pheap_alloc(heap, 1 + rand_r(&seed) % 5000);
+            }
+        }
+        struct timespec pause = {0, 2000000};
+        nanosleep(&pause, 0);
+        kill(pid, SIGKILL);
+        waitpid(pid, 0, 0);
+        void* obj = pheap_alloc(heap, 64);
+        pheap_free(heap, obj);
+    }
+    printf("share: killed %d workers, %lu died holding the lock, heap still usable\n", rounds,
+           (unsigned long) heap->recoveries);
+
+    // Free a large run twice after it has merged into the free run before it; the second free
+    // must abort
+    pid_t pid = fork();
+    if (pid == 0) {
+        void* before = pheap_alloc(heap, 8 * 4096);
+        void* large = pheap_alloc(heap, 8 * 4096);
+        void* after = pheap_alloc(heap, 8 * 4096);
+        pheap_free(heap, before);
+        pheap_free(heap, large);
+        pheap_free(heap, large);
+        pheap_free(heap, after);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    int caught = WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+    printf("share: double free of a large run %s\n", caught ? "aborted" : "was not caught");
+    failed += !caught;
+    xfree(rings);
+    pheap_close(heap);
+    return failed == 0 ? 0 : 1;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        printf("Usage:\n");
+        printf("\t%s heap GIB\n", argv[0]);
+        printf("\t%s burst COUNT ROUNDS\n", argv[0]);
+        printf("\t%s threads N OPS\n", argv[0]);
+        printf("\t%s spawn N\n", argv[0]);
+        printf("\t%s trim COUNT\n", argv[0]);
+        printf("\t%s frag OPS\n", argv[0]);
+        printf("\t%s list COUNT\n", argv[0]);
+        printf("\t%s deferred N OPS\n", argv[0]);
+        printf("\t%s pc PAIRS OPS\n", argv[0]);
+        printf("\t%s exitfree\n", argv[0]);
+        printf("\t%s guard overflow|uaf|double|zero|edge\n", argv[0]);
+        printf("\t%s walk N OPS\n", argv[0]);
+        printf("\t%s mem small|pow2|ivec|tail steady|phases|fifo OPS\n", argv[0]);
+        printf("\t%s ctl COUNT\n", argv[0]);
+        printf("\t%s persist build|crash|load PATH COUNT\n", argv[0]);
+        printf("\t%s share PROCS OPS\n", argv[0]);
+        return 1;
+    }
+
+    if (strcmp(argv[1], "heap") == 0 && argc == 3) {
+        return bench_heap(atof(argv[2]));
+    }
+
+    if (strcmp(argv[1], "burst") == 0 && argc == 4) {
+        return bench_burst(atol(argv[2]), atol(argv[3]));
+    }
+
+    if (strcmp(argv[1], "threads") == 0 && argc == 4) {
+        return bench_threads(atoi(argv[2]), atol(argv[3]));
+    }
+
+    if (strcmp(argv[1], "spawn") == 0 && argc == 3) {
+        return bench_spawn(atol(argv[2]));
+    }
+
+    if (strcmp(argv[1], "trim") == 0 && argc == 3) {
+        return bench_trim(atol(argv[2]));
+    }
+
+    if (strcmp(argv[1], "frag") == 0 && argc == 3) {
+        return bench_frag(atol(argv[2]));
+    }
+
+    if (strcmp(argv[1], "list") == 0 && argc == 3) {
+        return bench_list(atol(argv[2]));
+    }
+
+    if (strcmp(argv[1], "deferred") == 0 && argc == 4) {
+        return bench_deferred(atoi(argv[2]), atol(argv[3]));
+    }
+
+    if (strcmp(argv[1], "exitfree") == 0) {
+        return bench_exitfree();
+    }
+
+    if (strcmp(argv[1], "pc") == 0 && argc == 4) {
+        return bench_pc(atoi(argv[2]), atol(argv[3]));
+    }
+
+    if (strcmp(argv[1], "mem") == 0 && argc == 5) {
+        const char* dists[] = {"small", "pow2", "ivec", "tail"};
+        const char* lives[] = {"steady", "phases", "fifo"};
+        int dist = -1;
+        int life = -1;
+        for (int ii = 0; ii < 4; ++ii) {
+            if (strcmp(argv[2], dists[ii]) == 0) {
+                dist = ii;
+            }
+        }
+        for (int ii = 0; ii < 3; ++ii) {
+            if (strcmp(argv[3], lives[ii]) == 0) {
+                life = ii;
+            }
+        }
+        if (dist == -1 || life == -1) {
+            printf("Unknown distribution or lifetime: %s %s\n", argv[2], argv[3]);
+            return 1;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "%s %s", argv[2], argv[3]);
+        return bench_mem(dist, life, name, atol(argv[4]));
+    }
+
+    if (strcmp(argv[1], "guard") == 0 && argc == 3) {
+        return bench_guard(argv[2]);
+    }
+
+    if (strcmp(argv[1], "walk") == 0 && argc == 4) {
+        return bench_walk(atoi(argv[2]), atol(argv[3]));
+    }
+
+    if (strcmp(argv[1], "ctl") == 0 && argc == 3) {
+        return bench_ctl(atol(argv[2]));
+    }
+
+    if (strcmp(argv[1], "persist") == 0 && argc == 5) {
+        return bench_persist(argv[2], argv[3], atol(argv[4]));
+    }
+
+    if (strcmp(argv[1], "share") == 0 && argc == 4) {
+        return bench_share(atoi(argv[2]), atol(argv[3]));
+    }
+
+    printf("Unknown mode: %s\n", argv[1]);
+    return 1;
+}
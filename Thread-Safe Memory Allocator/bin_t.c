@@ -1,7 +1,18 @@
 #include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "bin_t.h"
+#include "span_t.h"
+#include "conf_t.h"
+#include "pagemap_t.h"
+#include "lockstat_t.h"
+#include "probes.h"
+#include "size_class.h"
+
+// Descriptors of released bins, linked through next and reused before new ones are carved
+static bin_t *free_descriptors = NULL;
+static pthread_mutex_t descriptor_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void
 check_rv(long rv) {
@@ -15,45 +26,105 @@ check_rv(long rv) {
 
 void
 *map_memory(size_t size) {
-    void *ret = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    void *ret = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     check_rv((long) ret);
     return ret;
 }
 
 /**
- * Maps a new page of memory for a bin which uses chunks of the given size. Returns that bin's
- * address pointer.
+ * Returns a descriptor for a new bin, recycling one of a released bin if there is one.
+ */
+bin_t
+*alloc_descriptor() {
+    timed_lock(&descriptor_mutex, LOCK_DESCRIPTOR);
+    bin_t *bin = free_descriptors;
+    if (bin != NULL) {
+        free_descriptors = bin->next;
+    }
+    pthread_mutex_unlock(&descriptor_mutex);
+    return bin != NULL ? bin : meta_alloc(sizeof(bin_t));
+}
+
+void
+free_descriptor(bin_t *bin) {
+    timed_lock(&descriptor_mutex, LOCK_DESCRIPTOR);
+    bin->next = free_descriptors;
+    free_descriptors = bin;
+    pthread_mutex_unlock(&descriptor_mutex);
+}
+
+/**
+ * Takes a new run of pages for a bin of the given size class, and registers every page of it in
+ * the page map. Returns that bin's descriptor.
  *
- * @param size the size of each chunk in the bin
+ * @param size_class index into the size class table
  * @param tid thread id
- * @return the pointer to a new block of memory
+ * @param head the head of the chain the bin goes in, or NULL if the bin is a new head
+ * @return the descriptor of the new bin
  */
 bin_t
-*init_small_bin(size_t size, pthread_t tid) {
-    bin_t *bin = map_memory(PAGE_SIZE);
+*init_small_bin(int size_class, pthread_t tid, bin_t *head) {
+    const class_info *ci = &class_table[size_class];
+    bin_t *bin = alloc_descriptor();
     init_bitmap(&bin->bitmap);
+    bin->memory = span_alloc_pages(ci->pages);
+    PROBE3(bin_new, ci->size, ci->pages, bin->memory);
     bin->tid = tid;
     bin->is_large = false;
-    bin->bin_size = size;
+    bin->size_class = size_class;
+    bin->bin_size = ci->size;
+    bin->bin_bytes = ci->pages * PAGE_SIZE;
+    bin->head = head == NULL ? bin : head;
+    bin->count = 0;
+    bin->bucket = 0;
+    bin->prev = NULL;
     bin->next = NULL;
+    for (int ii = 0; ii < OCCUPANCY_BUCKETS; ++ii) {
+        bin->buckets[ii] = NULL;
+    }
+    bin->remote = NULL;
+    bin->exported_live = 0;
+    bin->exported_mapped = 0;
+    // A new head starts out as the only bin of its chain
+    if (head == NULL) {
+        bin->buckets[0] = bin;
+    }
     pthread_mutex_init(&bin->mutex, 0);
+    pagemap_set(bin->memory, bin->bin_bytes, bin);
     return bin;
 }
 
 /**
- * Maps a custom amount of memory for a large bin. Returns that bin's address pointer.
+ * Gives an empty bin's pages back and recycles its descriptor. The bin must not be in a chain, or
+ * locked.
+ */
+void
+destroy_small_bin(bin_t *bin) {
+    PROBE2(bin_release, bin->bin_size, bin->memory);
+    pagemap_set(bin->memory, bin->bin_bytes, NULL);
+    span_free_pages(bin->memory, bin->bin_bytes / PAGE_SIZE);
+    free_descriptor(bin);
+}
+
+/**
+ * Maps a custom amount of memory for a large bin, or reuses a recently freed mapping of about the
+ * same size. Only the first page is registered in the page map, since that is where the chunk
+ * starts. Returns that bin's descriptor.
  *
- * @param size the size of the full bin
+ * @param size the size of the chunk
  * @param tid thread id
- * @return the pointer to a new block of memory
+ * @return the descriptor of the new bin
  */
 bin_t
 *init_large_bin(size_t size, pthread_t tid) {
-    bin_t *bin = map_memory(size);
+    bin_t *bin = alloc_descriptor();
+    bin->memory = span_alloc_extent(&size);
+    PROBE2(large_alloc, size, bin->memory);
     bin->tid = tid;
     bin->is_large = true;
     bin->size_large = size;
     pthread_mutex_init(&bin->mutex, 0);
+    pagemap_set(bin->memory, PAGE_SIZE, bin);
     return bin;
 }
 
@@ -65,126 +136,496 @@ bin_t
  */
 int
 get_max_item_count(bin_t *bin) {
-    size_t space = PAGE_SIZE - sizeof(bin_t);
-    return (int) (space / bin->bin_size);
+    return class_table[bin->size_class].max_items;
+}
+
+/**
+ * ================================================================
+ * Occupancy buckets
+ * ================================================================
+ */
+
+/**
+ * Picks the bucket for a bin holding the given number of chunks.
+ *
+ * @param count chunks in use
+ * @param max_size chunks the bin can hold
+ * @return 0 for empty, OCCUPANCY_BUCKETS - 1 for full, and the quarter of occupancy in between
+ */
+static inline int
+get_bucket(int count, int max_size) {
+    if (count == 0) {
+        return 0;
+    }
+    if (count >= max_size) {
+        return OCCUPANCY_BUCKETS - 1;
+    }
+    return 1 + count * (OCCUPANCY_BUCKETS - 2) / max_size;
+}
+
+void
+unlink_bin(bin_t *head, bin_t *bin) {
+    if (bin->prev != NULL) {
+        bin->prev->next = bin->next;
+    } else {
+        head->buckets[bin->bucket] = bin->next;
+    }
+    if (bin->next != NULL) {
+        bin->next->prev = bin->prev;
+    }
+}
+
+void
+link_bin(bin_t *head, bin_t *bin, int bucket) {
+    bin->bucket = bucket;
+    bin->prev = NULL;
+    bin->next = head->buckets[bucket];
+    if (bin->next != NULL) {
+        bin->next->prev = bin;
+    }
+    head->buckets[bucket] = bin;
+}
+
+/**
+ * Moves a bin to the bucket matching its count. Must hold the head's mutex and the bin's mutex.
+ */
+static inline void
+update_bucket(bin_t *head, bin_t *bin, int max_size) {
+    int bucket = get_bucket(bin->count, max_size);
+    if (bucket != bin->bucket) {
+        unlink_bin(head, bin);
+        link_bin(head, bin, bucket);
+    }
 }
 
 /**
- * Given an index into a bit, returns the n-th available chunk of memory from that bin. This memory
- * might already have data but that does not matter. Offset by the size of the header.
+ * Takes a free chunk from a bin that has one and files the bin under its new occupancy. Must hold
+ * the head's mutex and the bin's mutex.
+ */
+static inline void
+*take_chunk(bin_t *head, bin_t *bin, size_t size, int max_size) {
+    int index = get_first_empty_bit(&bin->bitmap, max_size);
+    set_nth_bit(&bin->bitmap, index);
+    // Stored atomically since heap walks may read the count without the bin's mutex
+    __atomic_store_n(&bin->count, bin->count + 1, __ATOMIC_RELAXED);
+    update_bucket(head, bin, max_size);
+    return bin->memory + index * size;
+}
+
+/**
+ * ================================================================
+ * Freeing
+ * ================================================================
+ */
+
+/**
+ * Unlinks an empty bin from the chain and gives its pages back. Must hold the head's mutex and the
+ * bin's mutex; the bin's mutex is released.
+ */
+void
+release_bin(bin_t *head, bin_t *bin) {
+    unlink_bin(head, bin);
+    pthread_mutex_unlock(&bin->mutex);
+    destroy_small_bin(bin);
+}
+
+/**
+ * Clears a chunk's bit and files the bin under its new occupancy, giving the bin back if it became
+ * empty and is not the head. Must hold the head's mutex and the bin's mutex.
+ *
+ * @return whether the bin was given back, in which case its mutex has been released
+ */
+static inline bool
+free_chunk_locked(bin_t *head, bin_t *bin, int index, int max_size) {
+    clear_nth_bit(&bin->bitmap, index);
+    __atomic_store_n(&bin->count, bin->count - 1, __ATOMIC_RELAXED);
+    if (bin->count == 0 && bin != head) {
+        release_bin(head, bin);
+        return true;
+    }
+    update_bucket(head, bin, max_size);
+    return false;
+}
+
+/**
+ * Frees a chunk of a bin. Most frees only take the bin's mutex; when the bin changes occupancy
+ * bucket the head's mutex is taken as well to move it, and a bin other than the head that became
+ * empty is given back. Taking the head while holding the bin cannot deadlock, since allocation
+ * only ever trylocks bins while it holds the head.
+ *
+ * @param bin the bin the chunk belongs to
+ * @param item the chunk
+ * @param magic reciprocal of the class's chunk size
+ * @param max_size chunks per bin of the class
+ */
+static inline __attribute__((always_inline)) void
+free_sized(bin_t *bin, void *item, uint32_t magic, int max_size) {
+    bin_t *head = bin->head;
+    int index = chunk_index(item - bin->memory, magic);
+    timed_lock(&bin->mutex, LOCK_BIN);
+    if (get_bucket(bin->count - 1, max_size) == bin->bucket || bin == head) {
+        // The head's mutex is the bin's own, so the head can always be refiled
+        free_chunk_locked(head, bin, index, max_size);
+    } else {
+        timed_lock(&head->mutex, LOCK_HEAD);
+        bool released = free_chunk_locked(head, bin, index, max_size);
+        pthread_mutex_unlock(&head->mutex);
+        if (released) {
+            return;
+        }
+    }
+    pthread_mutex_unlock(&bin->mutex);
+}
+
+/**
+ * Hands a batch of chunks freed by other threads to a chain with a single compare-and-swap. The
+ * chunks are linked through their first word, from first to last; whoever next takes the head's
+ * mutex frees them.
  *
- * @param bin to pull memory from
- * @param index 0-indexed chunk of memory
- * @return pointer to that memory
+ * @param head the head of the chain the chunks belong to
+ * @param first the first chunk of the batch
+ * @param last the last chunk of the batch
  */
 void
-*get_memory_at_nth_index(bin_t *bin, int index) {
-    void *alloc = (void *) bin;
-    alloc += sizeof(bin_t) + index * bin->bin_size;
-    return alloc;
+push_remote(bin_t *head, void *first, void *last) {
+    void *old = __atomic_load_n(&head->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **) last = old;
+    } while (!__atomic_compare_exchange_n(&head->remote, &old, first, true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
 }
 
 /**
- * Gets the available memory after the head, or returns available memory of a new bin.
+ * Frees every chunk other threads have handed to the chain, taking the whole list with one atomic
+ * exchange. Must hold the head's mutex. A bin's mutex is kept while consecutive chunks belong to
+ * it, and bins are only trylocked, as everywhere the head is held, so chunks of a busy bin go back
+ * on the list for next time.
+ */
+void
+drain_remote(bin_t *head, uint32_t magic, int max_size) {
+    if (__atomic_load_n(&head->remote, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    void *item = __atomic_exchange_n(&head->remote, NULL, __ATOMIC_ACQUIRE);
+    void *first = NULL;
+    void *last = NULL;
+    bin_t *locked = NULL;
+    while (item != NULL) {
+        void *next = *(void **) item;
+        bin_t *bin = pagemap_get(item);
+        if (bin != locked && locked != NULL) {
+            pthread_mutex_unlock(&locked->mutex);
+            locked = NULL;
+        }
+        if (bin == head || bin == locked || counted_trylock(&bin->mutex, LOCK_BIN)) {
+            locked = bin == head ? NULL : bin;
+            int index = chunk_index(item - bin->memory, magic);
+            if (free_chunk_locked(head, bin, index, max_size)) {
+                locked = NULL;
+            }
+        } else {
+            *(void **) item = first;
+            first = item;
+            last = last == NULL ? item : last;
+        }
+        item = next;
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->mutex);
+    }
+    if (first != NULL) {
+        push_remote(head, first, last);
+    }
+}
+
+/**
+ * ================================================================
+ * Allocation
+ * ================================================================
+ */
+
+/**
+ * Returns a free chunk of the chain, preferring the fullest bins that still have room so that
+ * nearly empty bins drain and can be given back. Empty bins are only used when no partly full bin
+ * is free, and a new bin is made when none is. The head's mutex guards the buckets of the whole
+ * chain, so the caller must hold it. Bins held by a thread that is freeing into them are skipped,
+ * and after search_limit of them a new bin is made rather than looking further.
  *
  * @param head the bin list head
- * @param max_size max number of items in the bin
+ * @param size_class the chain's size class
+ * @param size chunk size of the class
+ * @param max_size max number of items in a bin
  * @return the void pointer to free memory
  */
-void
-*get_memory_after_head(bin_t *head, int max_size) {
-    bin_t *cur = head->next;
-    int count = 0;
-    while (cur != NULL && count < 10) {
-        if (pthread_mutex_trylock(&cur->mutex) == 0) {
-            int available_memory_index = get_first_empty_bit(&cur->bitmap, max_size);
-            if (available_memory_index != -1) {
-                set_nth_bit(&cur->bitmap, available_memory_index);
+static inline __attribute__((always_inline)) void
+*get_memory_from_buckets(bin_t *head, int size_class, size_t size, int max_size) {
+    int tries = 0;
+    int limit = CONF(search_limit);
+    for (int bucket = OCCUPANCY_BUCKETS - 2; bucket >= 0 && tries < limit; --bucket) {
+        for (bin_t *cur = head->buckets[bucket]; cur != NULL && tries < limit; cur = cur->next) {
+            if (cur == head) {
+                return take_chunk(head, cur, size, max_size);
+            }
+            if (counted_trylock(&cur->mutex, LOCK_BIN)) {
+                void *memory = take_chunk(head, cur, size, max_size);
                 pthread_mutex_unlock(&cur->mutex);
-                return get_memory_at_nth_index(cur, available_memory_index);
+                return memory;
             }
-            pthread_mutex_unlock(&cur->mutex);
+            tries += 1;
         }
-        cur = cur->next;
-        count += 1;
     }
-    // If we've reached here, this means that we haven't found free memory in the first 10 bins
-    pthread_mutex_lock(&head->mutex);
-    bin_t *next = init_small_bin(head->bin_size, head->tid);
-    next->next = head->next;
-    head->next = next;
+    // Nobody else can see the new bin until it is linked, so its first chunk is ours
+    bin_t *bin = init_small_bin(size_class, head->tid, head);
+    link_bin(head, bin, 0);
+    return take_chunk(head, bin, size, max_size);
+}
+
+static inline __attribute__((always_inline)) void
+*get_memory_sized(bin_t *head, int size_class, size_t size, uint32_t magic, int max_size) {
+    timed_lock(&head->mutex, LOCK_HEAD);
+    drain_remote(head, magic, max_size);
+    void *memory = get_memory_from_buckets(head, size_class, size, max_size);
     pthread_mutex_unlock(&head->mutex);
-    // Grab the 0-th index memory
-    pthread_mutex_lock(&next->mutex);
-    set_nth_bit(&next->bitmap, 0);
-    void *memory = get_memory_at_nth_index(next, 0);
-    pthread_mutex_unlock(&next->mutex);
     return memory;
 }
 
 /**
- * Designed to be run at the head of the list of bins, returns the first available memory address it
- * finds. If there's no existing memory, it creates a new bin, inserts the bin just following the
- * head, and returns available memory from that bin.
+ * ================================================================
+ * Size class specializations
+ * ================================================================
+ */
+
+// One allocation and one free function per default size class, with the class's chunk size,
+// reciprocal and bin capacity built in as constants, reached through a table indexed by class.
+// Tuned classes pass the same values from class_table instead.
+#define CLASS_PATHS(ci, size, pages) \
+    static void *alloc_class_##ci(bin_t *head) { \
+        return get_memory_sized(head, ci, size, CLASS_MAGIC(size), CLASS_ITEMS(size, pages)); \
+    } \
+    static void free_class_##ci(bin_t *bin, void *item) { \
+        free_sized(bin, item, CLASS_MAGIC(size), CLASS_ITEMS(size, pages)); \
+    }
+SIZE_CLASSES(CLASS_PATHS)
+
+#define ALLOC_ENTRY(ci, size, pages) alloc_class_##ci,
+#define FREE_ENTRY(ci, size, pages) free_class_##ci,
+static void *(*const class_alloc[NUM_OF_BIN_SIZES])(bin_t *) = {SIZE_CLASSES(ALLOC_ENTRY)};
+static void (*const class_free[NUM_OF_BIN_SIZES])(bin_t *, void *) = {SIZE_CLASSES(FREE_ENTRY)};
+
+/**
+ * Designed to be run at the head of the list of bins, returns a free chunk from the chain. If no
+ * bin has room, it creates a new bin, links it into the chain, and returns memory from that bin.
  *
- * @param bin head bin
+ * @param head head bin
+ * @param size_class the chain's size class
  * @return void pointer to available memory
  */
 void
-*get_memory(bin_t *bin) {
-    // Check if there's any available memory in the "head". This is where we start checking and
-    // iterating through each of our equally-sized bins. If no memory is available
-    int max_size = get_max_item_count(bin);
-    pthread_mutex_lock(&bin->mutex);
-    int available_memory_index = get_first_empty_bit(&bin->bitmap, max_size);
-    if (available_memory_index != -1) {
-        set_nth_bit(&bin->bitmap, available_memory_index);
-        void *memory = get_memory_at_nth_index(bin, available_memory_index);
-        pthread_mutex_unlock(&bin->mutex);
-        return memory;
-    } else {
-        pthread_mutex_unlock(&bin->mutex);
+*get_memory(bin_t *head, int size_class) {
+    if (classes_tuned) {
+        const class_info *ci = &class_table[size_class];
+        return get_memory_sized(head, size_class, ci->size, ci->magic, ci->max_items);
+    }
+    return class_alloc[size_class](head);
+}
+
+/**
+ * Frees a chunk of a small bin.
+ *
+ * @param bin the bin the chunk belongs to
+ * @param item the chunk
+ */
+void
+free_small_chunk(bin_t *bin, void *item) {
+    if (classes_tuned) {
+        const class_info *ci = &class_table[bin->size_class];
+        free_sized(bin, item, ci->magic, ci->max_items);
+        return;
     }
+    class_free[bin->size_class](bin, item);
+}
 
-    // If there's valid memory down the chain, return it. Otherwise, build a new bin and grab the
-    // available memory from that bin.
-    return get_memory_after_head(bin, max_size);
+/**
+ * Takes the free chunk of a bin that is closest after the given address, or before it if there is
+ * none after. Must hold the head's mutex and the bin's mutex.
+ */
+void
+*take_chunk_near(bin_t *head, bin_t *bin, void *addr, int max_size) {
+    int start = 0;
+    if (addr >= bin->memory && addr < bin->memory + bin->bin_bytes) {
+        start = chunk_index(addr - bin->memory, class_table[bin->size_class].magic);
+    }
+    int index = get_empty_bit_near(&bin->bitmap, start, max_size);
+    set_nth_bit(&bin->bitmap, index);
+    __atomic_store_n(&bin->count, bin->count + 1, __ATOMIC_RELAXED);
+    update_bucket(head, bin, max_size);
+    return bin->memory + index * bin->bin_size;
 }
 
+/**
+ * Returns a free chunk of the chain as close to a hint address as possible: in the hint's own bin
+ * if it belongs to the chain, or else in a bin of the chain on the pages around it, up to
+ * NEAR_PAGES away without leaving the hint's span. Candidates are found through the page map and
+ * only trusted once the head's mutex is held, since bins only join or leave the chain under it.
+ *
+ * @param head the bin list head
+ * @param hint address to allocate near
+ * @return the chunk, or NULL if no bin near the hint has room
+ */
 void
-free_small_bin(bin_t *bin, int index_of_offset, bin_t *head) {
-    pthread_mutex_lock(&bin->mutex);
-    clear_nth_bit(&bin->bitmap, index_of_offset);
-    // Be sure to remove the bin if it's completely empty and not the head
-    if (bin != head) {
-        int max_size = get_max_item_count(bin);
-        // Check if the bin is empty
-        if (get_first_nonempty_bit(&bin->bitmap, max_size + 1) == -1) {
-            bin_t *prev = head;
-            bin_t *cur = head->next;
-            while (bin != cur && cur != NULL) {
-                prev = cur;
-                cur = cur->next;
+*get_memory_near(bin_t *head, void *hint) {
+    int max_size = get_max_item_count(head);
+    uintptr_t span = (uintptr_t) hint & ~((uintptr_t) SPAN_SIZE - 1);
+    void *memory = NULL;
+    bin_t *last = NULL;
+    timed_lock(&head->mutex, LOCK_HEAD);
+    for (int ii = 0; ii <= 2 * NEAR_PAGES && memory == NULL; ++ii) {
+        // Try the hint's page, then one page after, one before, two after, and so on
+        long distance = ii % 2 == 0 ? ii / 2 : -(ii + 1) / 2;
+        uintptr_t addr = (uintptr_t) hint + distance * PAGE_SIZE;
+        if ((addr & ~((uintptr_t) SPAN_SIZE - 1)) != span) {
+            continue;
+        }
+        bin_t *bin = pagemap_get((void *) addr);
+        if (bin == NULL || bin == last || bin->is_large || bin->head != head ||
+            bin->count >= max_size) {
+            continue;
+        }
+        last = bin;
+        if (bin == head) {
+            memory = take_chunk_near(head, bin, hint, max_size);
+        } else if (counted_trylock(&bin->mutex, LOCK_BIN)) {
+            if (bin->count < max_size) {
+                memory = take_chunk_near(head, bin, hint, max_size);
             }
-            // If the previous gets freed
-            if (pthread_mutex_trylock(&prev->mutex)) {
-                pthread_mutex_unlock(&bin->mutex);
-                return;
+            pthread_mutex_unlock(&bin->mutex);
+        }
+    }
+    pthread_mutex_unlock(&head->mutex);
+    return memory;
+}
+
+/**
+ * Unlinks and gives back every empty bin after the head. If the head, or a bin, is held by another
+ * thread it is skipped so that allocating threads never wait on this.
+ *
+ * @param head the bin list head
+ * @return the number of bins given back
+ */
+long
+release_empty_bins(bin_t *head) {
+    long released = 0;
+    if (pthread_mutex_trylock(&head->mutex) != 0) {
+        return 0;
+    }
+    drain_remote(head, class_table[head->size_class].magic, get_max_item_count(head));
+    bin_t *cur = head->buckets[0];
+    while (cur != NULL) {
+        bin_t *next = cur->next;
+        if (cur != head && pthread_mutex_trylock(&cur->mutex) == 0) {
+            if (cur->count == 0) {
+                release_bin(head, cur);
+                released += 1;
+            } else {
+                pthread_mutex_unlock(&cur->mutex);
             }
-            if (cur != NULL) {
-                prev->next = cur->next;
+        }
+        cur = next;
+    }
+    pthread_mutex_unlock(&head->mutex);
+    return released;
+}
+
+/**
+ * Adds up a chain's usage for get_bin_usage and peek_bin_usage. Must hold the head's mutex.
+ */
+void
+add_bin_usage(bin_t *head, size_t *live, size_t *mapped) {
+    for (int bi = 0; bi < OCCUPANCY_BUCKETS; ++bi) {
+        for (bin_t *cur = head->buckets[bi]; cur != NULL; cur = cur->next) {
+            *live += (size_t) __atomic_load_n(&cur->count, __ATOMIC_RELAXED) * cur->bin_size;
+            *mapped += cur->bin_bytes;
+        }
+    }
+}
+
+/**
+ * Adds up the memory a chain hands out and the memory its bins hold. Counts of bins that are being
+ * freed into are read without their lock, so the result is approximate while threads run.
+ *
+ * @param head the bin list head
+ * @param live incremented by the bytes of chunks in use
+ * @param mapped incremented by the bytes of the chain's pages
+ */
+void
+get_bin_usage(bin_t *head, size_t *live, size_t *mapped) {
+    pthread_mutex_lock(&head->mutex);
+    add_bin_usage(head, live, mapped);
+    pthread_mutex_unlock(&head->mutex);
+}
+
+/**
+ * Adds up a chain's usage like get_bin_usage, for the stats file. The thread that exports them
+ * must never hold up one that allocates, so a chain whose head is busy is not waited for; what it
+ * held when it was last counted is added instead.
+ *
+ * @param head the bin list head
+ * @param live incremented by the bytes of chunks in use
+ * @param mapped incremented by the bytes of the chain's pages
+ */
+void
+peek_bin_usage(bin_t *head, size_t *live, size_t *mapped) {
+    if (pthread_mutex_trylock(&head->mutex) == 0) {
+        size_t chain_live = 0;
+        size_t chain_mapped = 0;
+        add_bin_usage(head, &chain_live, &chain_mapped);
+        pthread_mutex_unlock(&head->mutex);
+        head->exported_live = chain_live;
+        head->exported_mapped = chain_mapped;
+    }
+    *live += head->exported_live;
+    *mapped += head->exported_mapped;
+}
+
+/**
+ * Counts the bins of a chain and the chunks in them for a heap walk. The head's mutex keeps bins
+ * from being released meanwhile. Bins are only trylocked, since a free holding a bin may be
+ * waiting for the head; the chunks of a bin that is busy are taken from its count instead of its
+ * bitmap. Chunks sitting in per-CPU caches or on remote lists count as live.
+ *
+ * @param head the bin list head
+ * @param hc incremented by the chain's bins, chunks and bytes
+ */
+void
+walk_chain(bin_t *head, heap_class *hc) {
+    const class_info *ci = &class_table[head->size_class];
+    timed_lock(&head->mutex, LOCK_HEAD);
+    for (int bi = 0; bi < OCCUPANCY_BUCKETS; ++bi) {
+        for (bin_t *cur = head->buckets[bi]; cur != NULL; cur = cur->next) {
+            int live;
+            if (cur == head) {
+                live = count_set_bits(&cur->bitmap, ci->max_items);
+            } else if (counted_trylock(&cur->mutex, LOCK_BIN)) {
+                live = count_set_bits(&cur->bitmap, ci->max_items);
+                pthread_mutex_unlock(&cur->mutex);
             } else {
-                prev->next = NULL;
+                live = __atomic_load_n(&cur->count, __ATOMIC_RELAXED);
             }
-            pthread_mutex_unlock(&prev->mutex);
-            munmap(bin, PAGE_SIZE);
-            return;
+            hc->bins += 1;
+            hc->live_chunks += live;
+            hc->free_chunks += ci->max_items - live;
+            hc->overhead_bytes += sizeof(bin_t);
+            hc->slack_bytes += cur->bin_bytes - (size_t) ci->max_items * ci->size;
+            hc->mapped_bytes += cur->bin_bytes;
         }
     }
-    pthread_mutex_unlock(&bin->mutex);
+    pthread_mutex_unlock(&head->mutex);
 }
 
 void
 free_large_bin(bin_t *bin) {
-    munmap(bin, bin->size_large);
-}
\ No newline at end of file
+    PROBE2(large_free, bin->size_large, bin->memory);
+    pagemap_set(bin->memory, PAGE_SIZE, NULL);
+    span_free_extent(bin->memory, bin->size_large);
+    free_descriptor(bin);
+}
@@ -7,14 +7,35 @@
 #include "bitmap_t.h"
 
 #define PAGE_SIZE 4096
+// Bins of a chain are grouped by how full they are: empty, four quarters of partly full, and full
+#define OCCUPANCY_BUCKETS 6
+// How many pages away from a hint opt_malloc_near looks for room
+#define NEAR_PAGES 16
+
+void check_rv(long rv);
 
 void *map_memory(size_t size);
 
+// Describes one run of pages. Descriptors live apart from the pages they describe, so chunks fill
+// their pages completely and a chunk's bin is found through the page map.
 typedef struct bin_s {
     // For small bins only
     bitmap_t bitmap;
+    int size_class;
     size_t bin_size;
+    size_t bin_bytes;
+    struct bin_s *head;
+    int count;
+    int bucket;
+    struct bin_s *prev;
+    // For head bins only, the chain's bins by occupancy, and chunks other threads have freed
+    struct bin_s *buckets[OCCUPANCY_BUCKETS];
+    void *remote;
+    // For head bins only, the chain's usage as the stats file last counted it
+    size_t exported_live;
+    size_t exported_mapped;
     // Shared
+    void *memory;
     pthread_t tid;
     pthread_mutex_t mutex;
     struct bin_s *next;
@@ -23,14 +44,44 @@ typedef struct bin_s {
     size_t size_large;
 } bin_t;
 
-bin_t *init_small_bin(size_t size, pthread_t tid);
+// What one size class of one arena holds, or with size_class -1 all large chunks, which belong to
+// no arena. Filled in by opt_heap_walk.
+typedef struct heap_class {
+    int arena;
+    int size_class;
+    size_t chunk_size;
+    long bins;
+    long live_chunks;
+    long free_chunks;
+    // Bytes of bin descriptors, which are kept apart from the chunks
+    size_t overhead_bytes;
+    // Bytes at the end of bins too short to hold another chunk
+    size_t slack_bytes;
+    size_t mapped_bytes;
+} heap_class;
+
+bin_t *init_small_bin(int size_class, pthread_t tid, bin_t *head);
+
+void destroy_small_bin(bin_t *bin);
 
 bin_t *init_large_bin(size_t size, pthread_t tid);
 
-void free_small_bin(bin_t *bin, int index_of_offset, bin_t *head);
+void free_small_chunk(bin_t *bin, void *item);
+
+void push_remote(bin_t *head, void *first, void *last);
+
+long release_empty_bins(bin_t *head);
+
+void get_bin_usage(bin_t *head, size_t *live, size_t *mapped);
+
+void peek_bin_usage(bin_t *head, size_t *live, size_t *mapped);
+
+void walk_chain(bin_t *head, heap_class *hc);
 
 void free_large_bin(bin_t *bin);
 
-void *get_memory(bin_t *bin);
+void *get_memory(bin_t *head, int size_class);
+
+void *get_memory_near(bin_t *head, void *hint);
 
 #endif //CS3650_BIN_T_H
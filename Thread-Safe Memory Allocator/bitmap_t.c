@@ -78,6 +78,39 @@ get_first_nonempty_bit(bitmap_t *bm, int max_size) {
     return check_bits(bm, max_size, false);
 }
 
+int
+get_empty_bit_near(bitmap_t *bm, int n, int max_size) {
+    // Look at the bits after n first, then the ones before it, so that ties go forward
+    for (int ii = n; ii < max_size; ++ii) {
+        if (get_nth_bit(bm, ii) == 0) {
+            return ii;
+        }
+    }
+    for (int ii = n - 1; ii >= 0; --ii) {
+        if (get_nth_bit(bm, ii) == 0) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Counts the bits that are set among the first max_size.
+ */
+int
+count_set_bits(bitmap_t *bm, int max_size) {
+    int count = 0;
+    for (int ii = 0; ii * 8 < max_size; ii += sizeof(long)) {
+        unsigned long l = *((unsigned long *) &(bm->bitmap[ii]));
+        int bits = max_size - ii * 8;
+        if (bits < 64) {
+            l &= (1UL << bits) - 1;
+        }
+        count += __builtin_popcountl(l);
+    }
+    return count;
+}
+
 #define MAIN 0 // Turn off debugging by setting this to 0
 #if MAIN
 
@@ -18,4 +18,8 @@ int get_first_empty_bit(bitmap_t *bm, int max_size);
 
 int get_first_nonempty_bit(bitmap_t *bm, int max_size);
 
+int get_empty_bit_near(bitmap_t *bm, int n, int max_size);
+
+int count_set_bits(bitmap_t *bm, int max_size);
+
 #endif
@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/sysinfo.h>
+#include <pthread.h>
+#include "bin_t.h"
+#include "cache_t.h"
+#include "conf_t.h"
+
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#endif
+
+static cache_t *caches;
+static int num_caches;
+// Chunks of each class a cache holds before it gives half back, up to CACHE_CAPACITY
+static int capacity = CACHE_CAPACITY;
+static pthread_mutex_t caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * ================================================================
+ * CPU lookup
+ * ================================================================
+ */
+
+/**
+ * Returns the CPU this thread is running on. The kernel keeps cpu_id up to date in the thread's
+ * registered rseq area, so reading it is a plain load; sched_getcpu is the fallback where glibc
+ * did not register one.
+ *
+ * @return the current CPU number
+ */
+int
+current_cpu() {
+#ifdef HAVE_RSEQ
+    if (__rseq_size > 0) {
+        struct rseq *rs = (struct rseq *) ((char *) __builtin_thread_pointer() + __rseq_offset);
+        int cpu = (int) *(volatile __u32 *) &rs->cpu_id;
+        if (cpu >= 0) {
+            return cpu;
+        }
+    }
+#endif
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu;
+}
+
+void
+init_caches() {
+    num_caches = get_nprocs_conf();
+    capacity = opt_config.cache_capacity;
+    caches = map_memory(num_caches * sizeof(cache_t));
+}
+
+/**
+ * Returns the cache of the current CPU, giving it its own arena on first use.
+ */
+cache_t
+*get_cache() {
+    cache_t *c = &caches[current_cpu() % num_caches];
+    if (c->bins == NULL) {
+        pthread_mutex_lock(&caches_mutex);
+        if (c->bins == NULL) {
+            c->bins = new_bins_list();
+        }
+        pthread_mutex_unlock(&caches_mutex);
+    }
+    return c;
+}
+
+/**
+ * Claims a cache with a single atomic. It can only be taken already if this thread was preempted
+ * or migrated at the wrong moment, so callers go around the cache rather than wait.
+ */
+bool
+try_claim(cache_t *c) {
+    return !__atomic_test_and_set(&c->busy, __ATOMIC_ACQUIRE);
+}
+
+void
+release(cache_t *c) {
+    __atomic_clear(&c->busy, __ATOMIC_RELEASE);
+}
+
+/**
+ * ================================================================
+ * Allocation
+ * ================================================================
+ */
+
+/**
+ * Returns a chunk of the given class from the current CPU's cache, refilling half of the cache
+ * from that CPU's bins when it runs dry.
+ *
+ * @param size_class index into class_table
+ * @return pointer to a free chunk
+ */
+void
+*cache_malloc(int size_class) {
+    cache_t *c = get_cache();
+    bin_t *head = get_head(c->bins, size_class);
+    if (!try_claim(c)) {
+        return get_memory(head, size_class);
+    }
+    int count = c->counts[size_class];
+    if (count == 0) {
+        for (; count < capacity / 2; ++count) {
+            c->items[size_class][count] = get_memory(head, size_class);
+        }
+    }
+    count -= 1;
+    void *item = c->items[size_class][count];
+    c->counts[size_class] = count;
+    release(c);
+    return item;
+}
+
+/**
+ * Puts a freed chunk in the current CPU's cache. When the cache is full, the older half is
+ * returned to its bins first.
+ *
+ * @param item the chunk
+ * @param bin the bin the chunk came from
+ */
+void
+cache_free(void *item, bin_t *bin) {
+    cache_t *c = get_cache();
+    if (!try_claim(c)) {
+        free_small_item(bin, item);
+        return;
+    }
+    int size_class = bin->size_class;
+    int count = c->counts[size_class];
+    void **items = c->items[size_class];
+    if (count >= capacity) {
+        int half = capacity / 2;
+        for (int ii = 0; ii < half; ++ii) {
+            free_small_item(get_bin(items[ii]), items[ii]);
+        }
+        for (int ii = half; ii < count; ++ii) {
+            items[ii - half] = items[ii];
+        }
+        count -= half;
+    }
+    items[count] = item;
+    c->counts[size_class] = count + 1;
+    release(c);
+}
+
+/**
+ * Returns every cached chunk to its bin so that the bins can be trimmed. Caches that are in use
+ * are skipped.
+ */
+void
+flush_caches() {
+    if (caches == NULL) {
+        return;
+    }
+    for (int ci = 0; ci < num_caches; ++ci) {
+        cache_t *c = &caches[ci];
+        if (c->bins == NULL || !try_claim(c)) {
+            continue;
+        }
+        for (int si = 0; si < NUM_OF_BIN_SIZES; ++si) {
+            for (int ii = 0; ii < c->counts[si]; ++ii) {
+                void *item = c->items[si][ii];
+                free_small_item(get_bin(item), item);
+            }
+            c->counts[si] = 0;
+        }
+        release(c);
+    }
+}
+
+/**
+ * Counts the chunks held by all per-CPU caches. The caches are read without being claimed, so the
+ * result is approximate while threads run.
+ *
+ * @param bytes incremented by the bytes of the cached chunks
+ * @return the number of cached chunks
+ */
+long
+cached_chunks(size_t *bytes) {
+    long chunks = 0;
+    if (caches == NULL) {
+        return 0;
+    }
+    for (int ci = 0; ci < num_caches; ++ci) {
+        for (int si = 0; si < NUM_OF_BIN_SIZES; ++si) {
+            int count = __atomic_load_n(&caches[ci].counts[si], __ATOMIC_RELAXED);
+            chunks += count;
+            *bytes += count * class_table[si].size;
+        }
+    }
+    return chunks;
+}
@@ -0,0 +1,26 @@
+#ifndef CS3650_CACHE_T_H
+#define CS3650_CACHE_T_H
+
+#include "opt_malloc.h"
+
+#define CACHE_CAPACITY 32
+
+// Free chunks kept by one CPU, on its own cache lines so that CPUs never share one
+typedef struct cache_s {
+    char busy;
+    bins_list *bins;
+    int counts[NUM_OF_BIN_SIZES];
+    void *items[NUM_OF_BIN_SIZES][CACHE_CAPACITY];
+} __attribute__((aligned(64))) cache_t;
+
+void init_caches();
+
+void *cache_malloc(int size_class);
+
+void cache_free(void *item, bin_t *bin);
+
+void flush_caches();
+
+long cached_chunks(size_t *bytes);
+
+#endif //CS3650_CACHE_T_H
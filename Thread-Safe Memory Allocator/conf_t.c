@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "conf_t.h"
+#include "cache_t.h"
+
+// Bounds of the large extent cache in span_t.c
+#define MAX_LARGE_CACHED 64
+
+opt_conf opt_config = {
+        .thp = 0,
+        .span_pages = 64,
+        .decay_ms = 1000,
+        .large_max = 64 * 1024 * 1024,
+        .large_cached = MAX_LARGE_CACHED,
+        .percpu = 0,
+        .arenas = -1,
+        .arena_load = 0,
+        .cache_capacity = CACHE_CAPACITY,
+        .search_limit = 10,
+        .stats = 0,
+        .stats_ms = 10,
+        .guard_rate = 0,
+        .guard_slots = 256,
+        .profile_rate = 16,
+        .profile_warmup = 0,
+};
+
+typedef enum conf_when {
+    // Only read when the allocator starts
+    CONF_STARTUP,
+    // Can be changed with opt_mallctl at any time
+    CONF_RUNTIME,
+    // Can be changed with opt_mallctl if it was on when the allocator started
+    CONF_RUNTIME_IF_ON
+} conf_when;
+
+typedef struct conf_option {
+    const char *name;
+    // The variable that sets the option on its own, from before OPT_MALLOC_CONF
+    const char *env;
+    long *value;
+    char *string;
+    long min;
+    long max;
+    // Words accepted for the values 0, 1, ..., if any
+    const char *words[3];
+    conf_when when;
+    bool was_on;
+} conf_option;
+
+#define NUMBER(name, env, min, max, when) \
+        {#name, env, &opt_config.name, NULL, min, max, {NULL, NULL, NULL}, when, false}
+#define SWITCH(name, env, when) \
+        {#name, env, &opt_config.name, NULL, 0, 1, {"false", "true", NULL}, when, false}
+#define PATH(name, env) \
+        {#name, env, NULL, opt_config.name, 0, 0, {NULL, NULL, NULL}, CONF_STARTUP, false}
+
+static conf_option options[] = {
+        SWITCH(thp, "OPT_MALLOC_THP", CONF_STARTUP),
+        NUMBER(span_pages, NULL, 8, 512, CONF_RUNTIME),
+        NUMBER(decay_ms, "OPT_MALLOC_DECAY_MS", 0, LONG_MAX, CONF_RUNTIME),
+        NUMBER(large_max, NULL, 0, LONG_MAX, CONF_RUNTIME),
+        NUMBER(large_cached, NULL, 0, MAX_LARGE_CACHED, CONF_RUNTIME),
+        SWITCH(percpu, "OPT_MALLOC_PERCPU", CONF_STARTUP),
+        NUMBER(arenas, "OPT_MALLOC_ARENAS", -1, 4096, CONF_STARTUP),
+        {"arena_load", "OPT_MALLOC_ARENA_POLICY", &opt_config.arena_load, NULL, 0, 1,
+         {"rr", "load", NULL}, CONF_STARTUP, false},
+        NUMBER(cache_capacity, NULL, 2, CACHE_CAPACITY, CONF_STARTUP),
+        NUMBER(search_limit, NULL, 1, 1 << 20, CONF_RUNTIME),
+        SWITCH(stats, NULL, CONF_RUNTIME),
+        NUMBER(stats_ms, "OPT_MALLOC_STATS_MS", 1, LONG_MAX, CONF_STARTUP),
+        PATH(stats_file, "OPT_MALLOC_STATS_FILE"),
+        NUMBER(guard_rate, "OPT_MALLOC_GUARD_RATE", 0, LONG_MAX, CONF_RUNTIME_IF_ON),
+        NUMBER(guard_slots, "OPT_MALLOC_GUARD_SLOTS", 1, 1 << 20, CONF_STARTUP),
+        PATH(profile, "OPT_MALLOC_PROFILE"),
+        PATH(profile_out, "OPT_MALLOC_PROFILE_OUT"),
+        NUMBER(profile_rate, "OPT_MALLOC_PROFILE_RATE", 0, LONG_MAX, CONF_RUNTIME_IF_ON),
+        NUMBER(profile_warmup, "OPT_MALLOC_PROFILE_WARMUP", 0, LONG_MAX, CONF_STARTUP),
+};
+
+#define NUM_OPTIONS (int) (sizeof(options) / sizeof(options[0]))
+#define CONF_VALUE(opt) __atomic_load_n((opt)->value, __ATOMIC_RELAXED)
+
+static pthread_once_t conf_once = PTHREAD_ONCE_INIT;
+
+/**
+ * ================================================================
+ * Parsing
+ * ================================================================
+ */
+
+/**
+ * Reports a setting that cannot be used. Written straight to stderr since nothing may allocate
+ * while the allocator starts.
+ */
+void
+complain(const char *source, const char *problem, const char *text, size_t len) {
+    char line[256];
+    int n = snprintf(line, sizeof(line), "opt_malloc: %s: %s '%.*s'\n", source, problem,
+                     (int) (len < 64 ? len : 64), text);
+    if (write(STDERR_FILENO, line, n < (int) sizeof(line) ? (size_t) n : sizeof(line) - 1) < 0) {
+        return;
+    }
+}
+
+conf_option
+*find_option(const char *name, size_t len) {
+    for (int ii = 0; ii < NUM_OPTIONS; ++ii) {
+        if (strlen(options[ii].name) == len && strncmp(options[ii].name, name, len) == 0) {
+            return &options[ii];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Reads a number, which may end in k, m or g for KiB, MiB or GiB.
+ *
+ * @return whether the text was a number and nothing else
+ */
+bool
+parse_number(const char *text, size_t len, long *out) {
+    size_t ii = 0;
+    bool negative = len > 0 && text[0] == '-';
+    ii += negative;
+    if (ii == len) {
+        return false;
+    }
+    long value = 0;
+    for (; ii < len && text[ii] >= '0' && text[ii] <= '9'; ++ii) {
+        if (value > (LONG_MAX - 9) / 10) {
+            return false;
+        }
+        value = value * 10 + (text[ii] - '0');
+    }
+    if (ii + 1 == len) {
+        int shift = text[ii] == 'k' ? 10 : text[ii] == 'm' ? 20 : text[ii] == 'g' ? 30 : -1;
+        if (shift == -1 || value > LONG_MAX >> shift) {
+            return false;
+        }
+        value <<= shift;
+        ii += 1;
+    }
+    *out = negative ? -value : value;
+    return ii == len;
+}
+
+bool
+set_option(conf_option *opt, const char *text, size_t len) {
+    if (opt->string != NULL) {
+        if (len >= CONF_PATH_MAX) {
+            return false;
+        }
+        memcpy(opt->string, text, len);
+        opt->string[len] = 0;
+        return true;
+    }
+    for (int ii = 0; ii < 3 && opt->words[ii] != NULL; ++ii) {
+        if (strlen(opt->words[ii]) == len && strncmp(opt->words[ii], text, len) == 0) {
+            *opt->value = ii;
+            return true;
+        }
+    }
+    long value;
+    if (!parse_number(text, len, &value) || value < opt->min || value > opt->max) {
+        return false;
+    }
+    *opt->value = value;
+    return true;
+}
+
+/**
+ * Applies a jemalloc-style string of comma-separated name:value pairs, such as
+ * "decay_ms:0,arenas:8,stats_file:/tmp/stats". Works within the string itself, so nothing is
+ * allocated; pairs that cannot be used are reported and skipped.
+ */
+void
+parse_conf(const char *conf) {
+    const char *cur = conf;
+    while (*cur != 0) {
+        const char *colon = cur;
+        while (*colon != 0 && *colon != ':' && *colon != ',') {
+            ++colon;
+        }
+        const char *end = colon;
+        while (*end != 0 && *end != ',') {
+            ++end;
+        }
+        conf_option *opt = *colon == ':' ? find_option(cur, colon - cur) : NULL;
+        if (end == cur) {
+            // An empty pair, as in a trailing comma
+        } else if (*colon != ':') {
+            complain("OPT_MALLOC_CONF", "expected name:value, got", cur, end - cur);
+        } else if (opt == NULL) {
+            complain("OPT_MALLOC_CONF", "unknown option", cur, colon - cur);
+        } else if (!set_option(opt, colon + 1, end - colon - 1)) {
+            complain("OPT_MALLOC_CONF", "bad value", cur, end - cur);
+        }
+        cur = *end == ',' ? end + 1 : end;
+    }
+}
+
+/**
+ * Reads the settings: the variables each setting used to have first, then OPT_MALLOC_CONF, which
+ * overrides them. Sampling without anywhere to put its samples is switched off here, so that the
+ * settings read back as what is in effect.
+ */
+void
+read_conf() {
+    for (int ii = 0; ii < NUM_OPTIONS; ++ii) {
+        char *env = options[ii].env != NULL ? getenv(options[ii].env) : NULL;
+        if (env != NULL && !set_option(&options[ii], env, strlen(env))) {
+            complain(options[ii].env, "bad value", env, strlen(env));
+        }
+    }
+    char *conf = getenv("OPT_MALLOC_CONF");
+    if (conf != NULL) {
+        parse_conf(conf);
+    }
+    if (opt_config.profile_out[0] == 0) {
+        opt_config.profile_rate = 0;
+    }
+    for (int ii = 0; ii < NUM_OPTIONS; ++ii) {
+        options[ii].was_on = options[ii].value != NULL && *options[ii].value != 0;
+    }
+}
+
+void
+load_conf() {
+    pthread_once(&conf_once, read_conf);
+}
+
+/**
+ * Prints the settings in effect, in the form OPT_MALLOC_CONF takes.
+ */
+void
+print_conf() {
+    fprintf(stderr, "Config:   ");
+    for (int ii = 0; ii < NUM_OPTIONS; ++ii) {
+        conf_option *opt = &options[ii];
+        const char *sep = ii + 1 < NUM_OPTIONS ? "," : "\n";
+        long value = opt->value != NULL ? CONF_VALUE(opt) : 0;
+        if (opt->string != NULL) {
+            fprintf(stderr, "%s:%s%s", opt->name, opt->string, sep);
+        } else if (opt->words[0] != NULL && value >= 0 && value < 3 && opt->words[value] != NULL) {
+            fprintf(stderr, "%s:%s%s", opt->name, opt->words[value], sep);
+        } else {
+            fprintf(stderr, "%s:%ld%s", opt->name, value, sep);
+        }
+    }
+}
+
+/**
+ * ================================================================
+ * Control
+ * ================================================================
+ */
+
+/**
+ * Reads and writes settings by name, in the manner of jemalloc's mallctl. Numbers are longs and
+ * paths are const char pointers. Any setting can be read; only those that are safe to change
+ * while threads allocate can be written, and the sampling rates only if sampling was on from the
+ * start, since that is when its memory is set up.
+ *
+ * @param name the setting, as named in OPT_MALLOC_CONF
+ * @param oldp if not NULL, where to store the value before any change
+ * @param oldlenp the size of *oldp; set to the size of the value
+ * @param newp if not NULL, the value to set
+ * @param newlen the size of *newp
+ * @return 0, or ENOENT for no such setting, EINVAL for a wrong size or out-of-range value, or
+ *         EPERM for a setting that cannot be changed now
+ */
+int
+opt_mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen) {
+    load_conf();
+    conf_option *opt = find_option(name, strlen(name));
+    if (opt == NULL) {
+        return ENOENT;
+    }
+    size_t size = opt->string != NULL ? sizeof(const char *) : sizeof(long);
+    if (oldp != NULL) {
+        if (oldlenp == NULL || *oldlenp != size) {
+            return EINVAL;
+        }
+        if (opt->string != NULL) {
+            *(const char **) oldp = opt->string;
+        } else {
+            *(long *) oldp = CONF_VALUE(opt);
+        }
+    }
+    if (newp == NULL) {
+        return 0;
+    }
+    if (opt->when == CONF_STARTUP || (opt->when == CONF_RUNTIME_IF_ON && !opt->was_on)) {
+        return EPERM;
+    }
+    if (newlen != sizeof(long)) {
+        return EINVAL;
+    }
+    long value = *(long *) newp;
+    if (value < opt->min || value > opt->max) {
+        return EINVAL;
+    }
+    __atomic_store_n(opt->value, value, __ATOMIC_RELAXED);
+    return 0;
+}
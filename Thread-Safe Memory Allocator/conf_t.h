@@ -0,0 +1,46 @@
+#ifndef CS3650_CONF_T_H
+#define CS3650_CONF_T_H
+
+#include <stddef.h>
+
+#define CONF_PATH_MAX 256
+
+// Every setting of the allocator, read once from the environment before the first allocation.
+// Numbers are longs so that opt_mallctl can read and write them all the same way.
+typedef struct opt_conf {
+    // Spans and the page cache
+    long thp;
+    long span_pages;
+    long decay_ms;
+    long large_max;
+    long large_cached;
+    // Arenas and caches
+    long percpu;
+    long arenas;
+    long arena_load;
+    long cache_capacity;
+    long search_limit;
+    // Stats and sampling
+    long stats;
+    long stats_ms;
+    long guard_rate;
+    long guard_slots;
+    long profile_rate;
+    long profile_warmup;
+    char stats_file[CONF_PATH_MAX];
+    char profile[CONF_PATH_MAX];
+    char profile_out[CONF_PATH_MAX];
+} opt_conf;
+
+extern opt_conf opt_config;
+
+// Reads a setting that opt_mallctl may change while threads run
+#define CONF(field) __atomic_load_n(&opt_config.field, __ATOMIC_RELAXED)
+
+void load_conf();
+
+void print_conf();
+
+int opt_mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen);
+
+#endif //CS3650_CONF_T_H
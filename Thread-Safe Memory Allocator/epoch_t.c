@@ -0,0 +1,229 @@
+#include <pthread.h>
+#include "bin_t.h"
+#include "span_t.h"
+#include "opt_malloc.h"
+#include "epoch_t.h"
+
+static pthread_once_t epochs_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+static unsigned long global_epoch = 0;
+// Records of every thread that has used epochs; records of exited threads are reused
+static epoch_record *records = NULL;
+// Batches left behind by exited threads, reclaimed by whichever thread gets to them first. Written
+// under orphans_mutex, but stored atomically so that reclaim can check for any without it.
+static retired_batch *orphans = NULL;
+static pthread_mutex_t orphans_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+__thread epoch_record *epoch_rec;
+__thread int epoch_depth = 0;
+// The batch retired chunks are going into, and full batches waiting for the epoch to move on
+__thread retired_batch *filling;
+__thread retired_batch *sealed;
+
+/**
+ * ================================================================
+ * Thread records
+ * ================================================================
+ */
+
+void
+append_batches(retired_batch **list, retired_batch *batches) {
+    while (*list != NULL) {
+        list = &(*list)->next;
+    }
+    __atomic_store_n(list, batches, __ATOMIC_RELAXED);
+}
+
+/**
+ * Stamps the batch being filled with the current epoch and puts it with the ones waiting.
+ */
+void
+seal_batch() {
+    if (filling == NULL) {
+        return;
+    }
+    filling->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    filling->next = sealed;
+    sealed = filling;
+    filling = NULL;
+}
+
+/**
+ * Runs when a thread that used epochs exits. Its retired chunks can't be freed yet, so they are
+ * left for the other threads to reclaim, and its record is given up for the next thread.
+ */
+void
+leave_epochs(void *arg) {
+    epoch_record *rec = arg;
+    seal_batch();
+    if (sealed != NULL) {
+        pthread_mutex_lock(&orphans_mutex);
+        append_batches(&orphans, sealed);
+        pthread_mutex_unlock(&orphans_mutex);
+        sealed = NULL;
+    }
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->claimed, false, __ATOMIC_RELEASE);
+}
+
+void
+create_epoch_key() {
+    pthread_key_create(&epoch_key, leave_epochs);
+}
+
+void
+init_epochs() {
+    pthread_once(&epochs_once, create_epoch_key);
+}
+
+/**
+ * Returns the calling thread's record, claiming one on first use. A record given up by an exited
+ * thread is reused if there is one; otherwise a new one is pushed onto the front of the list, which
+ * is never shrunk so that it can be walked without a lock.
+ */
+epoch_record
+*get_record() {
+    if (epoch_rec != NULL) {
+        return epoch_rec;
+    }
+    init_epochs();
+    epoch_record *rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+    for (; rec != NULL; rec = rec->next) {
+        bool expected = false;
+        if (__atomic_compare_exchange_n(&rec->claimed, &expected, true, false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (rec == NULL) {
+        rec = meta_alloc(sizeof(epoch_record));
+        rec->claimed = true;
+        rec->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&records, &rec->next, rec, true, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_setspecific(epoch_key, rec);
+    epoch_rec = rec;
+    return rec;
+}
+
+/**
+ * ================================================================
+ * Critical sections
+ * ================================================================
+ */
+
+/**
+ * Starts a critical section. Chunks that other threads retire from now on stay allocated until the
+ * section ends, so any pointer read inside it can be followed safely. Sections nest.
+ */
+void
+opt_epoch_enter() {
+    epoch_record *rec = get_record();
+    if (epoch_depth++ == 0) {
+        unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+        // Sequentially consistent, so that no load inside the section is done before this store
+        __atomic_store_n(&rec->state, (epoch << 1) | 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void
+opt_epoch_exit() {
+    if (--epoch_depth == 0) {
+        __atomic_store_n(&epoch_rec->state, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * ================================================================
+ * Reclamation
+ * ================================================================
+ */
+
+/**
+ * Moves the global epoch on if every thread in a critical section has seen the current one.
+ */
+void
+try_advance() {
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    for (epoch_record *rec = __atomic_load_n(&records, __ATOMIC_ACQUIRE); rec != NULL;
+         rec = rec->next) {
+        unsigned long state = __atomic_load_n(&rec->state, __ATOMIC_SEQ_CST);
+        if ((state & 1) && (state >> 1) != epoch) {
+            return;
+        }
+    }
+    __atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, false, __ATOMIC_SEQ_CST,
+                                __ATOMIC_RELAXED);
+}
+
+/**
+ * Frees every waiting batch that no thread can still reach. A batch stamped with epoch e was full
+ * before the epoch moved past e, and the epoch can only reach e + 2 once every thread that was in
+ * a critical section during e has left it.
+ */
+void
+reclaim() {
+    if (__atomic_load_n(&orphans, __ATOMIC_RELAXED) != NULL) {
+        pthread_mutex_lock(&orphans_mutex);
+        append_batches(&sealed, orphans);
+        __atomic_store_n(&orphans, NULL, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&orphans_mutex);
+    }
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    retired_batch **link = &sealed;
+    while (*link != NULL) {
+        retired_batch *batch = *link;
+        if (batch->epoch + 2 > epoch) {
+            link = &batch->next;
+            continue;
+        }
+        *link = batch->next;
+        for (int ii = 0; ii < batch->count; ++ii) {
+            opt_free(batch->items[ii]);
+        }
+        opt_free(batch);
+    }
+}
+
+/**
+ * Frees a chunk once no thread can be reading it any more: after every thread that is in a critical
+ * section now has left it. Chunks are collected per thread, and each time a batch fills up the
+ * epoch is moved on if it can be and every batch that has become safe goes back to the bins.
+ *
+ * @param item a chunk returned by opt_malloc that has been unlinked from every shared structure
+ */
+void
+opt_free_deferred(void *item) {
+    if (item == NULL) {
+        return;
+    }
+    get_record();
+    if (filling == NULL) {
+        filling = opt_malloc(sizeof(retired_batch));
+        filling->count = 0;
+    }
+    filling->items[filling->count++] = item;
+    if (filling->count < EPOCH_BATCH) {
+        return;
+    }
+    seal_batch();
+    try_advance();
+    reclaim();
+}
+
+/**
+ * Frees whatever retired chunks have become safe without waiting for a batch to fill: the calling
+ * thread's, even those in a batch that is not full, and those of exited threads. Called by
+ * opt_trim, since otherwise they are only freed when a thread fills another batch.
+ */
+void
+reclaim_deferred() {
+    seal_batch();
+    // Twice, since a batch is only safe two epochs on; the second fails if a thread is still
+    // inside a section from before the first
+    try_advance();
+    try_advance();
+    reclaim();
+}
@@ -0,0 +1,35 @@
+#ifndef CS3650_EPOCH_T_H
+#define CS3650_EPOCH_T_H
+
+#include <stdbool.h>
+
+// Retired chunks are handed back in batches of this many
+#define EPOCH_BATCH 64
+
+// A batch of retired chunks, stamped with the global epoch once it is full
+typedef struct retired_batch {
+    void *items[EPOCH_BATCH];
+    int count;
+    unsigned long epoch;
+    struct retired_batch *next;
+} retired_batch;
+
+// What the other threads need to know about one thread: the epoch it entered in, shifted left by
+// one, with the low bit set while it is inside a critical section
+typedef struct epoch_record {
+    unsigned long state;
+    bool claimed;
+    struct epoch_record *next;
+} __attribute__((aligned(64))) epoch_record;
+
+void init_epochs();
+
+void opt_epoch_enter();
+
+void opt_epoch_exit();
+
+void opt_free_deferred(void *item);
+
+void reclaim_deferred();
+
+#endif //CS3650_EPOCH_T_H
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "export_t.h"
+#include "conf_t.h"
+
+static export_page *page = NULL;
+
+/**
+ * Writes a snapshot into the file. A reader that copies it at the same time sees seq change and
+ * tries again, so it never gets half of one snapshot and half of another. The snapshot is stored a
+ * word at a time with atomic stores, since readers in other processes load it while it changes.
+ */
+void
+publish(export_stats *es) {
+    unsigned long seq = page->seq;
+    __atomic_store_n(&page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    const long *src = (const long *) es;
+    long *dst = (long *) &page->stats;
+    for (size_t ii = 0; ii < sizeof(export_stats) / sizeof(long); ++ii) {
+        __atomic_store_n(&dst[ii], src[ii], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Publishes a snapshot every period. Runs on a thread of its own, so the threads that allocate do
+ * no extra work and make no syscalls for the export, and it never waits for a chain head one of
+ * them holds.
+ */
+void
+*export_loop(void *arg) {
+    (void) arg;
+    struct timespec period = {page->period_ms / 1000, (page->period_ms % 1000) * 1000000};
+    export_stats es;
+    for (long samples = 1;; ++samples) {
+        memset(&es, 0, sizeof(es));
+        fill_export_stats(&es);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        es.published_ns = ts.tv_sec * 1000000000L + ts.tv_nsec;
+        es.samples = samples;
+        publish(&es);
+        nanosleep(&period, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * Starts publishing the allocator's stats if stats_file names a file to publish them to; %p in the
+ * name is replaced by the process id. stats_ms sets how often a snapshot is taken, 10 ms by
+ * default. The file is left behind with the last snapshot in it.
+ */
+void
+start_export() {
+    char *env = opt_config.stats_file;
+    if (env[0] == 0) {
+        return;
+    }
+    char path[4096];
+    size_t len = 0;
+    for (char *cc = env; *cc != 0 && len < sizeof(path) - 32; ++cc) {
+        if (cc[0] == '%' && cc[1] == 'p') {
+            len += snprintf(path + len, sizeof(path) - len, "%d", getpid());
+            ++cc;
+        } else {
+            path[len++] = *cc;
+        }
+    }
+    path[len] = 0;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, sizeof(export_page)) == -1) {
+        perror("opt_malloc: stats file");
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    page = mmap(0, sizeof(export_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        page = NULL;
+        return;
+    }
+    page->pid = getpid();
+    page->period_ms = opt_config.stats_ms;
+    page->version = EXPORT_VERSION;
+    __atomic_store_n(&page->magic, EXPORT_MAGIC, __ATOMIC_RELEASE);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&thread, &attr, export_loop, NULL);
+    pthread_attr_destroy(&attr);
+}
@@ -0,0 +1,57 @@
+#ifndef CS3650_EXPORT_T_H
+#define CS3650_EXPORT_T_H
+
+#include <stdint.h>
+
+// Layout of the stats file. It only depends on this header, so that readers can be built without
+// the allocator.
+#define EXPORT_MAGIC 0x5453504f
+#define EXPORT_VERSION 1
+#define EXPORT_CLASSES 32
+
+typedef struct export_class {
+    long size;
+    long live_bytes;
+    long mapped_bytes;
+} export_class;
+
+// One snapshot of the allocator's state
+typedef struct export_stats {
+    long published_ns; // CLOCK_REALTIME
+    long samples;
+    long spans_mapped;
+    long span_bytes;
+    long pages_active;
+    long pages_dirty;
+    long pages_muzzy;
+    long pages_purged;
+    long pages_unmapped;
+    long extents_cached;
+    long large_bytes;
+    long arenas;
+    long idle_arenas;
+    long cached_chunks;
+    long cached_bytes;
+    long lock_waits;
+    long lock_wait_ns;
+    long trylock_failed;
+    int nclasses;
+    export_class classes[EXPORT_CLASSES];
+} export_stats;
+
+// The file. seq is odd while a snapshot is being written: readers copy stats and retry if seq was
+// odd or changed in the meantime.
+typedef struct export_page {
+    uint32_t magic;
+    uint32_t version;
+    long pid;
+    long period_ms;
+    unsigned long seq;
+    export_stats stats;
+} export_page;
+
+void start_export();
+
+void fill_export_stats(export_stats *es);
+
+#endif //CS3650_EXPORT_T_H
@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <execinfo.h>
+#include <sys/mman.h>
+#include "bin_t.h"
+#include "guard_t.h"
+#include "size_class.h"
+#include "conf_t.h"
+
+typedef enum guard_state {
+    GUARD_EMPTY,
+    GUARD_LIVE,
+    GUARD_FREED
+} guard_state;
+
+// A page holding one guarded chunk, with the stacks that last allocated and freed it
+typedef struct guard_slot {
+    void *item;
+    size_t size;
+    guard_state state;
+    // Next slot in the queue of slots to hand out
+    int next;
+    pthread_t alloc_tid;
+    pthread_t free_tid;
+    int alloc_frames;
+    int free_frames;
+    void *alloc_stack[GUARD_FRAMES];
+    void *free_stack[GUARD_FRAMES];
+} guard_slot;
+
+__thread long guard_countdown = 0;
+__thread unsigned long guard_seed = 0;
+
+static int nslots = 0;
+// Slot i is the page at 2i + 1; the even pages between them are never accessible
+static char *pool = NULL;
+static char *pool_end = NULL;
+static guard_slot *slots = NULL;
+// Slots are reused oldest freed first, so a freed chunk stays protected as long as possible
+static int queue_head = -1;
+static int queue_tail = -1;
+static pthread_mutex_t guard_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction previous;
+static long sampled = 0;
+static long live = 0;
+static long pool_full = 0;
+
+/**
+ * ================================================================
+ * Slots
+ * ================================================================
+ */
+
+void
+enqueue_slot(int idx) {
+    slots[idx].next = -1;
+    if (queue_tail == -1) {
+        queue_head = idx;
+    } else {
+        slots[queue_tail].next = idx;
+    }
+    queue_tail = idx;
+}
+
+int
+dequeue_slot() {
+    int idx = queue_head;
+    if (idx != -1) {
+        queue_head = slots[idx].next;
+        if (queue_head == -1) {
+            queue_tail = -1;
+        }
+    }
+    return idx;
+}
+
+char
+*slot_page(int idx) {
+    return pool + (2 * (size_t) idx + 1) * PAGE_SIZE;
+}
+
+/**
+ * ================================================================
+ * Fault reports
+ * ================================================================
+ */
+
+void
+report(const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len > (int) sizeof(line) - 1) {
+        len = sizeof(line) - 1;
+    }
+    if (write(STDERR_FILENO, line, len) < 0) {
+        return;
+    }
+}
+
+void
+report_stacks(guard_slot *s) {
+    report("%zu-byte chunk at %p allocated by thread %lu:\n", s->size, s->item,
+           (unsigned long) s->alloc_tid);
+    backtrace_symbols_fd(s->alloc_stack, s->alloc_frames, STDERR_FILENO);
+    if (s->state == GUARD_FREED) {
+        report("freed by thread %lu:\n", (unsigned long) s->free_tid);
+        backtrace_symbols_fd(s->free_stack, s->free_frames, STDERR_FILENO);
+    }
+}
+
+/**
+ * Hands a fault outside the pool to whatever handled SIGSEGV before. If that was the default, the
+ * default is put back, and the faulting access runs again and kills the process as usual.
+ */
+void
+chain_fault(int sig, siginfo_t *info, void *context) {
+    if (previous.sa_flags & SA_SIGINFO) {
+        previous.sa_sigaction(sig, info, context);
+    } else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+        previous.sa_handler(sig);
+    } else {
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
+
+/**
+ * Reports a fault in the pool as an overflow or underflow when it hit a guard page, or as a use
+ * after free when it hit a freed chunk's page, blaming the chunk next to the address. The default
+ * handler is then put back so that the access faults again and the process dies with SIGSEGV.
+ */
+void
+guard_fault(int sig, siginfo_t *info, void *context) {
+    char *addr = info->si_addr;
+    if (addr < pool || addr >= pool_end) {
+        chain_fault(sig, info, context);
+        return;
+    }
+    size_t page = (addr - pool) / PAGE_SIZE;
+    guard_slot *s = NULL;
+    const char *kind;
+    if (page % 2 == 1) {
+        s = &slots[page / 2];
+        kind = s->state == GUARD_FREED ? "use after free" : "access outside any chunk";
+    } else {
+        guard_slot *left = page > 0 ? &slots[page / 2 - 1] : NULL;
+        guard_slot *right = (int) (page / 2) < nslots ? &slots[page / 2] : NULL;
+        if (left != NULL && left->state == GUARD_EMPTY) {
+            left = NULL;
+        }
+        if (right != NULL && right->state == GUARD_EMPTY) {
+            right = NULL;
+        }
+        // Chunks end against the page after them, so the one before is the likelier culprit
+        if (left != NULL && (right == NULL || addr - (char *) left->item - left->size <=
+                                              (size_t) ((char *) right->item - addr))) {
+            s = left;
+            kind = "buffer overflow";
+        } else {
+            s = right;
+            kind = "buffer underflow";
+        }
+    }
+    report("\nopt_malloc: %s at %p\n", kind, addr);
+    if (s != NULL) {
+        report_stacks(s);
+    }
+    signal(SIGSEGV, SIG_DFL);
+}
+
+/**
+ * ================================================================
+ * Sampling
+ * ================================================================
+ */
+
+/**
+ * Sets up sampling if guard_rate:N asks for one in about every N small allocations to be guarded.
+ * guard_slots sets how many guarded chunks there can be at once, 256 by default; once they are all
+ * taken, sampled allocations are served normally.
+ */
+void
+init_guard() {
+    if (opt_config.guard_rate == 0) {
+        return;
+    }
+    nslots = opt_config.guard_slots;
+    size_t bytes = (2 * (size_t) nslots + 1) * PAGE_SIZE;
+    pool = mmap(0, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    check_rv((long) pool);
+    pool_end = pool + bytes;
+    slots = map_memory(nslots * sizeof(guard_slot));
+    for (int ii = 0; ii < nslots; ++ii) {
+        enqueue_slot(ii);
+    }
+    // The first backtrace loads the unwinder, which allocates; get that over with now
+    void *frames[1];
+    backtrace(frames, 1);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = guard_fault;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, &previous);
+}
+
+/**
+ * Called when a thread's countdown runs out. Picks the distance to its next sample at random,
+ * averaging the rate, so that no allocation pattern can keep stepping around the samples. A
+ * thread's first call only seeds its countdown. With sampling off the countdown is pushed far out,
+ * but not out of reach, so that opt_mallctl can turn it back on.
+ *
+ * @return whether the current allocation is sampled
+ */
+bool
+guard_resample() {
+    long rate = pool != NULL ? CONF(guard_rate) : 0;
+    if (rate == 0) {
+        guard_countdown = 1 << 20;
+        return false;
+    }
+    bool first = guard_seed == 0;
+    if (first) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        guard_seed = (uintptr_t) &guard_seed ^ (unsigned long) ts.tv_nsec ^ 1;
+    }
+    // xorshift64
+    guard_seed ^= guard_seed << 13;
+    guard_seed ^= guard_seed >> 7;
+    guard_seed ^= guard_seed << 17;
+    guard_countdown = 1 + (long) (guard_seed % (2 * (unsigned long) rate - 1));
+    return !first;
+}
+
+/**
+ * Serves a small allocation from a page of its own, with its end against an inaccessible page.
+ * The chunk is aligned like its size class would be, so it can only overflow by writing past what
+ * the class would have given it.
+ *
+ * @param bytes size of the chunk, no more than MAX_SMALL_SIZE
+ * @return the chunk, or NULL if every slot is taken
+ */
+void
+*guard_malloc(size_t bytes) {
+    pthread_mutex_lock(&guard_mutex);
+    int idx = dequeue_slot();
+    if (idx == -1) {
+        pool_full += 1;
+        pthread_mutex_unlock(&guard_mutex);
+        return NULL;
+    }
+    sampled += 1;
+    live += 1;
+    pthread_mutex_unlock(&guard_mutex);
+
+    guard_slot *s = &slots[idx];
+    size_t class_size = class_table[size_class_of(bytes)].size;
+    size_t align = class_size & -class_size;
+    if (align > 16) {
+        align = 16;
+    }
+    // A zero-byte chunk still needs a byte of its page, or it would point at the next slot
+    size_t rounded = ((bytes > 0 ? bytes : 1) + align - 1) & ~(align - 1);
+    char *page = slot_page(idx);
+    check_rv(mprotect(page, PAGE_SIZE, PROT_READ | PROT_WRITE));
+    s->item = page + PAGE_SIZE - rounded;
+    s->size = bytes;
+    s->alloc_tid = pthread_self();
+    s->alloc_frames = backtrace(s->alloc_stack, GUARD_FRAMES);
+    s->free_frames = 0;
+    s->state = GUARD_LIVE;
+    return s->item;
+}
+
+bool
+guard_owns(void *item) {
+    return (char *) item >= pool && (char *) item < pool_end;
+}
+
+/**
+ * Finds the slot a pointer into the pool belongs to.
+ *
+ * @return the slot, or -1 for the guard page after the last one
+ */
+int
+slot_index(void *item) {
+    size_t idx = ((char *) item - pool) / PAGE_SIZE / 2;
+    return idx < (size_t) nslots ? (int) idx : -1;
+}
+
+size_t
+guard_size(void *item) {
+    int idx = slot_index(item);
+    return idx == -1 ? 0 : slots[idx].size;
+}
+
+/**
+ * Frees a guarded chunk. Its page is made inaccessible and given back to the OS, and the slot
+ * waits behind every other free slot before it is reused. A pointer that is not a live guarded
+ * chunk is reported with the chunk's stacks, and the process aborted.
+ *
+ * @param item a pointer into the pool
+ */
+void
+guard_free(void *item) {
+    int idx = slot_index(item);
+    if (idx == -1) {
+        report("\nopt_malloc: invalid free of %p\n", item);
+        abort();
+    }
+    guard_slot *s = &slots[idx];
+    pthread_mutex_lock(&guard_mutex);
+    if (s->state != GUARD_LIVE || s->item != item) {
+        pthread_mutex_unlock(&guard_mutex);
+        report("\nopt_malloc: %s of %p\n", s->state == GUARD_FREED ? "double free" : "invalid free",
+               item);
+        if (s->state != GUARD_EMPTY) {
+            report_stacks(s);
+        }
+        abort();
+    }
+    s->state = GUARD_FREED;
+    live -= 1;
+    pthread_mutex_unlock(&guard_mutex);
+
+    s->free_tid = pthread_self();
+    s->free_frames = backtrace(s->free_stack, GUARD_FRAMES);
+    char *page = slot_page(s - slots);
+    check_rv(mprotect(page, PAGE_SIZE, PROT_NONE));
+    madvise(page, PAGE_SIZE, MADV_DONTNEED);
+    pthread_mutex_lock(&guard_mutex);
+    enqueue_slot(s - slots);
+    pthread_mutex_unlock(&guard_mutex);
+}
+
+void
+print_guard_stats() {
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&guard_mutex);
+    fprintf(stderr, "Guarded:  %ld sampled, %ld live, %ld missed with all %d slots taken\n",
+            sampled, live, pool_full, nslots);
+    pthread_mutex_unlock(&guard_mutex);
+}
@@ -0,0 +1,36 @@
+#ifndef CS3650_GUARD_T_H
+#define CS3650_GUARD_T_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Frames kept of the stacks that allocated and freed a guarded chunk
+#define GUARD_FRAMES 16
+
+// Small allocations left until this thread samples one; stays far off when sampling is off
+extern __thread long guard_countdown;
+
+void init_guard();
+
+bool guard_resample();
+
+void *guard_malloc(size_t bytes);
+
+bool guard_owns(void *item);
+
+void guard_free(void *item);
+
+size_t guard_size(void *item);
+
+void print_guard_stats();
+
+/**
+ * Tells whether this small allocation should come from the guarded pool. Only counts down a
+ * thread-local counter unless it is the one in guard_rate that is sampled.
+ */
+static inline bool
+guard_sample() {
+    return __builtin_expect(--guard_countdown <= 0, 0) && guard_resample();
+}
+
+#endif //CS3650_GUARD_T_H
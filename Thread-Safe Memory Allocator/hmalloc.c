@@ -1,8 +1,11 @@
-
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <sys/mman.h>
 #include <stdio.h>
 #include <memory.h>
+#include <pthread.h>
+#include <sys/sysinfo.h>
 
 #include "hmalloc.h"
 
@@ -17,8 +20,41 @@
 */
 
 const size_t PAGE_SIZE = 4096;
-static hm_stats stats; // This initializes the stats to 0.
-free_node *head = NULL;
+// Small chunks are carved from regions of this many pages
+#define REGION_PAGES 16
+#define REGION_SIZE (REGION_PAGES * 4096)
+// A region holds one chunk this big when nothing in it is in use
+#define REGION_CHUNK (REGION_SIZE - 16)
+#define MIN_CHUNK (sizeof(free_node) + sizeof(size_t))
+// One list per 16 bytes up to 1 KiB, then one per power of two up to a whole region
+#define EXACT_LISTS 63
+#define NUM_LISTS (EXACT_LISTS + 6)
+
+#define SIZE_MASK ((((size_t) 1 << HEAP_SHIFT) - 1) & ~(size_t) CHUNK_FLAGS)
+
+struct hm_heap {
+    pthread_mutex_t mutex;
+    int index;
+    hm_stats stats;
+    free_node *lists[NUM_LISTS];
+    // Bit n is set when list n has chunks in it
+    uint64_t nonempty[2];
+    // Regions with nothing in use; one is kept so that a chunk freed and allocated again in a loop
+    // does not map and unmap a region every time
+    long empty_regions;
+    // Chunks other threads freed while the heap was locked, linked through their first word
+    void *remote;
+} __attribute__((aligned(64)));
+
+static hm_heap heaps[MAX_HEAPS];
+static int num_heaps = 1;
+static unsigned int next_heap = 0;
+static pthread_once_t heaps_once = PTHREAD_ONCE_INIT;
+static __thread hm_heap *local_heap = NULL;
+// Large chunks are mapped and unmapped without a heap lock, so they are counted apart
+static long large_mapped = 0;
+static long large_unmapped = 0;
+static hm_stats total;
 
 /**
  * Uses mmap to map memory of given size.
@@ -26,196 +62,350 @@ free_node *head = NULL;
  * @param size
  * @return a pointer to that memory
  */
-void
+static void
 *map_memory(size_t size) {
-    return mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 }
 
 /**
- * Builds a new page as a free list and returns that free list.
- * @return the free list, NOT the offset
+ * ================================================================
+ * Boundary tags
+ * ================================================================
  */
-free_node *
-free_list_init() {
-    free_node *new_list = map_memory(PAGE_SIZE);
-    new_list->size = PAGE_SIZE;
-    new_list->next = NULL;
-    // Increase stats
-    stats.pages_mapped += 1;
-    return new_list;
+
+static size_t
+chunk_size(void *chunk) {
+    return ((data *) chunk)->size & SIZE_MASK;
+}
+
+static data *
+next_chunk(void *chunk) {
+    return chunk + chunk_size(chunk);
 }
 
 /**
-* Insert  the given node in sort order.
-*
-* @param node
-* @return the node that precedes the inserted node in the list
-*/
-free_node *
-free_list_insert(free_node *node) {
-    free_node *prev = NULL;
-    free_node *cur = head;
-    while (cur < node && cur != NULL) {
-        prev = cur;
-        cur = cur->next;
-    }
-    // Current free_node element is the head of the list
-    if (prev == NULL) {
-        head = node;
-        node->next = cur;
-    } else { // Current free_node element is inside of the list
-        prev->next = node;
-        node->next = cur;
-    }
-    return prev;
+ * Reads the tag of a chunk in use without holding its heap. Whoever holds the heap may be flipping
+ * CHUNK_PREV_USED in it at the same time; its size, heap and other flags stay put while it is used.
+ */
+static size_t
+read_tag(data *d) {
+    return __atomic_load_n(&d->size, __ATOMIC_RELAXED);
 }
 
 /**
- * Given the previous list element and the current list element, attempts to construct a new list
- * element in the remaining space of give size, and inserts that element inside the linked list
- * where the current element was.
- *
- * @param prev
- * @param cur
- * @param size
- * @returns size given to the allocation
+ * Updates a chunk's CHUNK_PREV_USED flag. Must hold the chunk's heap, which makes this the only
+ * writer; the store is atomic for the sake of read_tag.
  */
-size_t
-free_list_remove_replace_current(free_node *prev, const free_node *cur, size_t size) {
-    // Add a new free_node element to the remainder of the current
-    free_node *next = cur->next;
-    // We want to make sure that there are no gaps of missing data if we choose not to allocate
-    size_t size_of_alloc = size;
-    // If we have a remainder of free memory left, create the new struct there
-    if (size + sizeof(free_node) < cur->size) {
-        next = ((void *) cur) + size;
-        next->size = cur->size - size;
-        next->next = cur->next;
+static void
+set_prev_used(data *d, bool used) {
+    size_t tag = used ? d->size | CHUNK_PREV_USED : d->size & ~(size_t) CHUNK_PREV_USED;
+    __atomic_store_n(&d->size, tag, __ATOMIC_RELAXED);
+}
+
+/**
+ * Writes a free chunk's tags: its header, and the copy of its size at its end.
+ */
+static void
+set_free_tags(free_node *node, size_t size) {
+    node->size = size | CHUNK_PREV_USED;
+    *(size_t *) ((void *) node + size - sizeof(size_t)) = size;
+}
+
+/**
+ * ================================================================
+ * Segregated free lists
+ * ================================================================
+ */
+
+static int
+floor_log2(size_t xx) {
+    return 63 - __builtin_clzl(xx);
+}
+
+/**
+ * Returns the list chunks of the given size go in. Up to 1 KiB every list holds one size, so any
+ * chunk in it fits; above that a list holds every size between two powers of two.
+ */
+static int
+list_index(size_t size) {
+    if (size <= 1024) {
+        return (int) (size / 16) - 2;
+    }
+    return EXACT_LISTS + floor_log2(size - 1) - 10;
+}
+
+void
+free_list_insert(hm_heap *heap, free_node *node) {
+    int li = list_index(chunk_size(node));
+    node->prev = NULL;
+    node->next = heap->lists[li];
+    if (node->next != NULL) {
+        node->next->prev = node;
+    }
+    heap->lists[li] = node;
+    heap->nonempty[li / 64] |= 1UL << (li % 64);
+    heap->stats.free_length += 1;
+}
+
+void
+free_list_remove(hm_heap *heap, free_node *node) {
+    int li = list_index(chunk_size(node));
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
     } else {
-        size_of_alloc = cur->size;
+        heap->lists[li] = node->next;
+        if (heap->lists[li] == NULL) {
+            heap->nonempty[li / 64] &= ~(1UL << (li % 64));
+        }
     }
-    // Current free_node element is the head of the list
-    if (prev == NULL) {
-        head = next;
-    } else { // Current free_node element is inside of the list
-        prev->next = next;
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
     }
-    return size_of_alloc;
+    heap->stats.free_length -= 1;
 }
 
 /**
- * Allocates the given size of space and returns a void pointer to that memory after the header. If
- * necessary, will create a new page.
+ * Finds a free chunk of at least the given size: the head of its own list if every chunk there
+ * fits, else the first that fits in it, else the head of the next list up that has any.
  *
- * @param size number of bytes to allocate, including the header
- * @return a void pointer to the allocated memory after the header
+ * @return the chunk, still in its list, or NULL if there is none
  */
-void *
-free_list_allocate(size_t size) {
-    free_node *prev = NULL;
-    free_node *cur = head;
-    while (cur != NULL) {
-        // We are going to return this
-        if (cur->size >= size) {
-            // Remove this free memory from the list
-            size_t true_size = free_list_remove_replace_current(prev, cur, size);
-            // Replace the free_node pointer with a data pointer
-            data *d = (data *) cur;
-            d->size = true_size;
-            // Return data at an offset
-            return ((void *) d) + sizeof(data);
-        } else {
-            // Visit the next element
-            prev = cur;
-            cur = cur->next;
+static free_node *
+free_list_find(hm_heap *heap, size_t size) {
+    int li = list_index(size);
+    if (li >= EXACT_LISTS) {
+        for (free_node *cur = heap->lists[li]; cur != NULL; cur = cur->next) {
+            if (chunk_size(cur) >= size) {
+                return cur;
+            }
         }
+        li += 1;
     }
-    // We've reached the end of the list. Allocate a new page
-    cur = free_list_init();
-    prev = free_list_insert(cur);
-    // Remove this memory from the list of free
-    free_list_remove_replace_current(prev, cur, size);
-    // Replace and return the data offset
-    data *d = (data *) cur;
-    d->size = size;
-    // Return data at an offset
-    return ((void *) d) + sizeof(data);
+    for (int wi = li / 64; wi < 2; ++wi) {
+        uint64_t bits = heap->nonempty[wi];
+        if (wi == li / 64) {
+            bits &= ~0UL << (li % 64);
+        }
+        if (bits != 0) {
+            return heap->lists[wi * 64 + __builtin_ctzl(bits)];
+        }
+    }
+    return NULL;
 }
 
 /**
- * Returns the number of elements in the free list
- * @return number of elements in the free list
+ * Maps a new region as one free chunk, between a word of padding that keeps payloads 16-byte
+ * aligned and an end tag that looks like a chunk in use.
+ * @return the free chunk, NOT the region
  */
-long
-free_list_length() {
-    long length = 0;
-    free_node *cur = head;
-    while (cur != NULL) {
-        length += 1;
-        cur = cur->next;
+free_node *
+free_list_init(hm_heap *heap) {
+    void *region = map_memory(REGION_SIZE);
+    free_node *node = region + sizeof(size_t);
+    set_free_tags(node, REGION_CHUNK);
+    ((data *) (region + REGION_SIZE - sizeof(size_t)))->size = CHUNK_USED;
+    // Increase stats
+    heap->stats.pages_mapped += REGION_PAGES;
+    return node;
+}
+
+/**
+ * ================================================================
+ * Allocation
+ * ================================================================
+ */
+
+/**
+ * Cuts a chunk in use down to the given size, and frees the rest if it is big enough to be a
+ * chunk. The chunk after it must be in use.
+ *
+ * @param d chunk in use, tagged with its whole size
+ * @param size size to keep
+ */
+static void
+split_chunk(hm_heap *heap, data *d, size_t size) {
+    size_t whole = chunk_size(d);
+    if (whole - size >= MIN_CHUNK) {
+        d->size = size | (d->size & ~SIZE_MASK);
+        free_node *rest = (void *) d + size;
+        set_free_tags(rest, whole - size);
+        free_list_insert(heap, rest);
+    } else {
+        set_prev_used(next_chunk(d), true);
     }
-    return length;
 }
 
 /**
- * Starting at the given element, traverses through the list and combines each element where their
- * memory addresses meet.
+ * Allocates a chunk of the given size and returns a void pointer to the memory after its header.
+ * If no free chunk is big enough, will map a new region.
  *
- * @param start first element to inspect for combination
+ * @param size size of the chunk, including the header
+ * @return a void pointer to the allocated memory after the header
  */
-void coalesce(free_node *start) {
-    free_node *prev = start;
-    free_node *cur = start->next;
-    while (cur != NULL) {
-        if (((void *) prev) + prev->size == cur) {
-            // Combine the previous and current
-            prev->size += cur->size;
-            prev->next = cur->next;
-            // Set the next
-            cur = cur->next;
-        } else {
-            prev = cur;
-            cur = cur->next;
-        }
+void *
+free_list_allocate(hm_heap *heap, size_t size) {
+    free_node *node = free_list_find(heap, size);
+    if (node == NULL) {
+        node = free_list_init(heap);
+        heap->empty_regions += 1;
+    } else {
+        free_list_remove(heap, node);
+    }
+    if (chunk_size(node) == REGION_CHUNK) {
+        heap->empty_regions -= 1;
     }
+    data *d = (data *) node;
+    d->size |= CHUNK_USED | (size_t) heap->index << HEAP_SHIFT;
+    split_chunk(heap, d, size);
+    // Return data at an offset
+    return ((void *) d) + sizeof(data);
 }
 
 /**
- * Creates a free_node struct at the given pointer and inserts it in the free list.
+ * Frees a small chunk, merging it with the chunks on either side if they are free. The boundary
+ * tags give both neighbours in constant time. A region left with nothing in use is unmapped,
+ * unless it is the only empty one.
  *
  * @param d data pointer
  */
 void
-free_list_free_and_coalesce(data *d) {
-    // Create a free_node struct and align it
+free_list_free_and_coalesce(hm_heap *heap, data *d) {
+    size_t size = chunk_size(d);
     free_node *node = (free_node *) d;
-    node->size = d->size;
-    node->next = NULL;
-    // Insert that node back into the list
-    free_node *prev = free_list_insert(node);
-    // If that node was the head, set correctly
-    if (prev == NULL) {
-        prev = head;
+    if (!(d->size & CHUNK_PREV_USED)) {
+        size_t prev_size = *(size_t *) ((void *) d - sizeof(size_t));
+        node = (void *) d - prev_size;
+        free_list_remove(heap, node);
+        size += prev_size;
+    }
+    data *next = (void *) node + size;
+    if (!(next->size & CHUNK_USED)) {
+        free_list_remove(heap, (free_node *) next);
+        size += chunk_size(next);
+        next = (void *) node + size;
+    }
+    set_prev_used(next, false);
+    if (size == REGION_CHUNK && heap->empty_regions > 0) {
+        munmap((void *) node - sizeof(size_t), REGION_SIZE);
+        heap->stats.pages_unmapped += REGION_PAGES;
+        return;
     }
-    // Coalesce the data from that point on
-    coalesce(prev);
+    if (size == REGION_CHUNK) {
+        heap->empty_regions += 1;
+    }
+    set_free_tags(node, size);
+    free_list_insert(heap, node);
 }
 
+/**
+ * ================================================================
+ * Heaps
+ * ================================================================
+ */
+
+/**
+ * Sets up the heaps. HMALLOC_HEAPS=N sets how many there are, up to MAX_HEAPS; the default is
+ * four per core, and HMALLOC_HEAPS=1 puts every thread behind a single lock.
+ */
+static void
+init_heaps() {
+    char *env = getenv("HMALLOC_HEAPS");
+    num_heaps = env != NULL && atoi(env) > 0 ? atoi(env) : 4 * get_nprocs();
+    if (num_heaps > MAX_HEAPS) {
+        num_heaps = MAX_HEAPS;
+    }
+    for (int ii = 0; ii < num_heaps; ++ii) {
+        pthread_mutex_init(&heaps[ii].mutex, 0);
+        heaps[ii].index = ii;
+    }
+}
+
+/**
+ * Returns the calling thread's heap. Threads are handed heaps round-robin the first time they
+ * allocate, and keep them.
+ */
+static hm_heap *
+get_local_heap() {
+    if (local_heap == NULL) {
+        pthread_once(&heaps_once, init_heaps);
+        unsigned int hi = __atomic_fetch_add(&next_heap, 1, __ATOMIC_RELAXED) % num_heaps;
+        local_heap = &heaps[hi];
+    }
+    return local_heap;
+}
+
+/**
+ * Hands a chunk to its heap's remote list, for when another thread holds the heap.
+ */
+static void
+push_remote(hm_heap *heap, void *item) {
+    void *old = __atomic_load_n(&heap->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **) item = old;
+    } while (!__atomic_compare_exchange_n(&heap->remote, &old, item, true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+static void
+free_locked(hm_heap *heap, void *item) {
+    heap->stats.chunks_freed += 1;
+    free_list_free_and_coalesce(heap, item - sizeof(data));
+}
+
+/**
+ * Locks a heap, and frees the chunks other threads left on its remote list in the meantime.
+ */
+static void
+lock_heap(hm_heap *heap) {
+    pthread_mutex_lock(&heap->mutex);
+    if (__atomic_load_n(&heap->remote, __ATOMIC_RELAXED) != NULL) {
+        void *item = __atomic_exchange_n(&heap->remote, NULL, __ATOMIC_ACQUIRE);
+        while (item != NULL) {
+            void *next = *(void **) item;
+            free_locked(heap, item);
+            item = next;
+        }
+    }
+}
+
+/**
+ * ================================================================
+ * Interface
+ * ================================================================
+ */
+
+/**
+ * Adds up the stats of every heap, after freeing whatever is on their remote lists.
+ */
 hm_stats *
 hgetstats() {
-    stats.free_length = free_list_length();
-    return &stats;
+    pthread_once(&heaps_once, init_heaps);
+    memset(&total, 0, sizeof(total));
+    for (int ii = 0; ii < num_heaps; ++ii) {
+        hm_heap *heap = &heaps[ii];
+        lock_heap(heap);
+        total.pages_mapped += heap->stats.pages_mapped;
+        total.pages_unmapped += heap->stats.pages_unmapped;
+        total.chunks_allocated += heap->stats.chunks_allocated;
+        total.chunks_freed += heap->stats.chunks_freed;
+        total.free_length += heap->stats.free_length;
+        pthread_mutex_unlock(&heap->mutex);
+    }
+    total.pages_mapped += __atomic_load_n(&large_mapped, __ATOMIC_RELAXED);
+    total.pages_unmapped += __atomic_load_n(&large_unmapped, __ATOMIC_RELAXED);
+    return &total;
 }
 
 void
 hprintstats() {
-    stats.free_length = free_list_length();
+    hm_stats *stats = hgetstats();
     fprintf(stderr, "\n== husky malloc stats ==\n");
-    fprintf(stderr, "Mapped:   %ld\n", stats.pages_mapped);
-    fprintf(stderr, "Unmapped: %ld\n", stats.pages_unmapped);
-    fprintf(stderr, "Allocs:   %ld\n", stats.chunks_allocated);
-    fprintf(stderr, "Frees:    %ld\n", stats.chunks_freed);
-    fprintf(stderr, "Freelen:  %ld\n", stats.free_length);
+    fprintf(stderr, "Heaps:    %d\n", num_heaps);
+    fprintf(stderr, "Mapped:   %ld\n", stats->pages_mapped);
+    fprintf(stderr, "Unmapped: %ld\n", stats->pages_unmapped);
+    fprintf(stderr, "Allocs:   %ld\n", stats->chunks_allocated);
+    fprintf(stderr, "Frees:    %ld\n", stats->chunks_freed);
+    fprintf(stderr, "Freelen:  %ld\n", stats->free_length);
 }
 
 static
@@ -232,68 +422,132 @@ div_up(size_t xx, size_t yy) {
     }
 }
 
+/**
+ * Returns the size of the chunk that holds the given number of bytes: the header, then the bytes
+ * rounded up to 16. A chunk in use needs no end tag, so its bytes may run into the last word.
+ */
+static size_t
+chunk_for(size_t bytes) {
+    size_t size = (bytes + sizeof(data) + 15) & ~(size_t) 15;
+    return size < MIN_CHUNK ? MIN_CHUNK : size;
+}
+
+/**
+ * Allocates from the calling thread's heap. Chunks of a page or more get a mapping of their own,
+ * which needs no lock at all.
+ */
 void *
 hmalloc(size_t size) {
-    // Handle stats
-    size += sizeof(data);
-    // Enforce 16 byte minimum
-    if (size < sizeof(free_node)) {
-        size = sizeof(free_node);
-    }
-    stats.chunks_allocated += 1;
-    if (size < PAGE_SIZE) {
-        // Initialize if the head does not exist
-        if (head == NULL) {
-            head = free_list_init();
-        }
-        return free_list_allocate(size);
+    size_t chunk = chunk_for(size);
+    if (chunk < PAGE_SIZE) {
+        hm_heap *heap = get_local_heap();
+        lock_heap(heap);
+        heap->stats.chunks_allocated += 1;
+        void *item = free_list_allocate(heap, chunk);
+        pthread_mutex_unlock(&heap->mutex);
+        return item;
     } else {
-        // Allocate at intervals of PAGE_SIZE
-        size_t num_pages = div_up(size, PAGE_SIZE);
-        data *d = map_memory(num_pages * PAGE_SIZE);
-        d->size = num_pages * PAGE_SIZE;
+        // Allocate at intervals of PAGE_SIZE, with the header placed so the data is 16-byte aligned
+        size_t num_pages = div_up(size + 2 * sizeof(data), PAGE_SIZE);
+        data *d = map_memory(num_pages * PAGE_SIZE) + sizeof(data);
+        d->size = num_pages * PAGE_SIZE | CHUNK_LARGE | CHUNK_USED;
         // Keep track of stats
-        stats.pages_mapped += num_pages;
+        __atomic_add_fetch(&large_mapped, num_pages, __ATOMIC_RELAXED);
         // Return data at an offset
         return ((void *) d) + sizeof(data);
     }
 }
 
 /**
- * Returns the size of allocated memory.
+ * Returns the number of bytes an allocation can hold.
  *
  * @param item the address of that memory
  * @return the size of the allocation
  */
 size_t
 get_size(void* item) {
-    data* d = item - sizeof(data);
-    return d->size;
+    size_t tag = read_tag(item - sizeof(data));
+    if (tag & CHUNK_LARGE) {
+        return (tag & SIZE_MASK) - 2 * sizeof(data);
+    }
+    return (tag & SIZE_MASK) - sizeof(data);
+}
+
+/**
+ * Tries to grow a small chunk in place by taking in the free chunk after it. Must hold the heap
+ * that owns the chunk.
+ *
+ * @return whether the chunk now holds the given size
+ */
+static int
+grow_in_place(hm_heap *heap, data *d, size_t size) {
+    data *next = next_chunk(d);
+    if (next->size & CHUNK_USED || chunk_size(d) + chunk_size(next) < size) {
+        return 0;
+    }
+    free_list_remove(heap, (free_node *) next);
+    if (chunk_size(next) == REGION_CHUNK) {
+        heap->empty_regions -= 1;
+    }
+    d->size += chunk_size(next);
+    split_chunk(heap, d, size);
+    return 1;
 }
 
 void*
 hrealloc(void* prev, size_t bytes) {
-    void *alloc = hmalloc(bytes);
-    if (get_size(prev) < bytes) {
-        memcpy(alloc, prev, bytes);
-        hfree(prev);
-        return alloc;
-    } else {
-        hfree(alloc);
+    if (prev == NULL) {
+        return hmalloc(bytes);
+    }
+    size_t have = get_size(prev);
+    if (bytes <= have) {
         return prev;
     }
+    data* d = prev - sizeof(data);
+    size_t tag = read_tag(d);
+    size_t chunk = chunk_for(bytes);
+    // Only grow chunks of our own heap, which we can lock without waiting on another thread
+    if (!(tag & CHUNK_LARGE) && chunk < PAGE_SIZE && &heaps[tag >> HEAP_SHIFT] == get_local_heap()) {
+        hm_heap *heap = local_heap;
+        lock_heap(heap);
+        int grown = grow_in_place(heap, d, chunk);
+        pthread_mutex_unlock(&heap->mutex);
+        if (grown) {
+            return prev;
+        }
+    }
+    void *alloc = hmalloc(bytes);
+    memcpy(alloc, prev, have);
+    hfree(prev);
+    return alloc;
 }
 
+/**
+ * Frees a chunk into the heap that owns it, which its tag names. A chunk of another thread's heap
+ * that is locked right now goes on that heap's remote list instead, so frees never wait on a
+ * heap other than the thread's own.
+ */
 void
 hfree(void *item) {
-    stats.chunks_freed += 1;
+    if (item == NULL) {
+        return;
+    }
     // Extract the data size from the pointer
     data *d = item - sizeof(data);
-    if (d->size < PAGE_SIZE) {
-        free_list_free_and_coalesce(d);
+    size_t tag = read_tag(d);
+    if (!(tag & CHUNK_LARGE)) {
+        hm_heap *heap = &heaps[tag >> HEAP_SHIFT];
+        if (heap == get_local_heap()) {
+            lock_heap(heap);
+        } else if (pthread_mutex_trylock(&heap->mutex) != 0) {
+            push_remote(heap, item);
+            return;
+        }
+        free_locked(heap, item);
+        pthread_mutex_unlock(&heap->mutex);
     } else {
-        size_t num_pages = div_up(d->size, PAGE_SIZE);
-        stats.pages_unmapped += num_pages;
-        munmap(item, d->size);
+        size_t num_pages = chunk_size(d) / PAGE_SIZE;
+        __atomic_add_fetch(&large_unmapped, num_pages, __ATOMIC_RELAXED);
+        munmap((void *) d - sizeof(data), chunk_size(d));
     }
 }
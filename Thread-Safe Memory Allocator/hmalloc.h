@@ -25,22 +25,36 @@ void* hrealloc(void* prev, size_t bytes);
 
 void hfree(void *item);
 
+// Every chunk starts with a boundary tag: its size, which is a multiple of 16, with the flags below
+// in the low bits and, in a chunk in use, the index of the heap that owns it in the top bits
+#define CHUNK_USED 1
+#define CHUNK_PREV_USED 2
+#define CHUNK_LARGE 4
+#define CHUNK_FLAGS 15
+#define HEAP_SHIFT 48
+#define MAX_HEAPS 64
+
+typedef struct data {
+    size_t size;
+} data;
+
+// A free chunk is linked into the list for its size, and repeats its size in its last word so
+// that the chunk after it can find its start
 typedef struct free_node {
     size_t size;
     struct free_node *next;
+    struct free_node *prev;
 } free_node;
 
-free_node* free_list_init();
+// An independently locked set of regions, free lists and stats
+typedef struct hm_heap hm_heap;
 
-free_node* free_list_insert(free_node *node);
+free_node *free_list_init(hm_heap *heap);
 
-void *free_list_allocate(size_t size);
+void free_list_insert(hm_heap *heap, free_node *node);
 
-size_t free_list_remove_replace_current(free_node *prev, const free_node *cur, size_t size);
-
-typedef struct data {
-    size_t size;
-} data;
+void free_list_remove(hm_heap *heap, free_node *node);
 
+void *free_list_allocate(hm_heap *heap, size_t size);
 
 #endif
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <time.h>
+#include "lockstat_t.h"
+#include "probes.h"
+
+static lock_stats stats[LOCK_CLASSES];
+static const char *lock_names[LOCK_CLASSES] = {"arena", "head", "bin", "span", "descriptor"};
+
+long
+now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * Locks a mutex, and if another thread holds it, adds the time spent waiting to its class. The
+ * clock is only read once the first trylock has failed.
+ *
+ * @param mutex the mutex to lock
+ * @param lc what the mutex guards
+ */
+void
+timed_lock(pthread_mutex_t *mutex, lock_class lc) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        return;
+    }
+    PROBE2(lock_contended, lc, mutex);
+    long start = now_ns();
+    pthread_mutex_lock(mutex);
+    long wait = now_ns() - start;
+    PROBE3(lock_wait, lc, mutex, wait);
+    lock_stats *ls = &stats[lc];
+    __atomic_add_fetch(&ls->contended, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&ls->wait_ns, wait, __ATOMIC_RELAXED);
+    long max = __atomic_load_n(&ls->max_wait_ns, __ATOMIC_RELAXED);
+    while (wait > max && !__atomic_compare_exchange_n(&ls->max_wait_ns, &max, wait, true,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Trylocks a mutex, counting the failures of its class.
+ *
+ * @return whether the mutex was taken
+ */
+bool
+counted_trylock(pthread_mutex_t *mutex, lock_class lc) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        return true;
+    }
+    PROBE2(trylock_failed, lc, mutex);
+    __atomic_add_fetch(&stats[lc].trylock_failed, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+lock_stats
+*lock_getstats(lock_class lc) {
+    return &stats[lc];
+}
+
+void
+print_lock_stats() {
+    fprintf(stderr, "Lock        Waits  Wait us   Max us  Trylock fails\n");
+    for (int ii = 0; ii < LOCK_CLASSES; ++ii) {
+        lock_stats *ls = &stats[ii];
+        fprintf(stderr, "%-10s %6ld %8ld %8ld %14ld\n", lock_names[ii], ls->contended,
+                ls->wait_ns / 1000, ls->max_wait_ns / 1000, ls->trylock_failed);
+    }
+}
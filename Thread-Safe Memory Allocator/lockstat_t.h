@@ -0,0 +1,34 @@
+#ifndef CS3650_LOCKSTAT_T_H
+#define CS3650_LOCKSTAT_T_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+// The allocator's locks, grouped by what they guard
+typedef enum lock_class {
+    LOCK_ARENA,      // handing arenas to threads
+    LOCK_HEAD,       // a size class chain, through its head bin
+    LOCK_BIN,        // a single bin
+    LOCK_SPAN,       // the span layer's page lists
+    LOCK_DESCRIPTOR, // recycled bin descriptors
+    LOCK_CLASSES
+} lock_class;
+
+// Contention on one class of locks. Uncontended acquisitions are not counted, so that they cost
+// nothing more than a trylock. Each class is on its own cache line.
+typedef struct lock_stats {
+    long contended;
+    long wait_ns;
+    long max_wait_ns;
+    long trylock_failed;
+} __attribute__((aligned(64))) lock_stats;
+
+void timed_lock(pthread_mutex_t *mutex, lock_class lc);
+
+bool counted_trylock(pthread_mutex_t *mutex, lock_class lc);
+
+lock_stats *lock_getstats(lock_class lc);
+
+void print_lock_stats();
+
+#endif //CS3650_LOCKSTAT_T_H
@@ -3,13 +3,104 @@
 #include <memory.h>
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
+#include <sys/sysinfo.h>
 #include "bin_t.h"
 #include "opt_malloc.h"
+#include "span_t.h"
+#include "cache_t.h"
+#include "pagemap_t.h"
+#include "remote_t.h"
+#include "epoch_t.h"
+#include "lockstat_t.h"
+#include "export_t.h"
+#include "guard_t.h"
+#include "profile_t.h"
+#include "conf_t.h"
 
 // Thread-local linked list of bins
 __thread bins_list *bin_list;
 static arena_list *arenas;
+// Arenas of threads that have exited, ready to be handed to new threads
+static bins_list *idle_arenas = NULL;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+static bool per_cpu = false;
+// Shared arenas that threads are assigned to, or none for one arena per thread
+static bins_list **pool = NULL;
+static int pool_size = 0;
+static bool least_loaded = false;
+static unsigned int next_arena = 0;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t arena_key;
+
+/**
+ * ================================================================
+ * Configuration
+ * ================================================================
+ */
+
+/**
+ * Runs when a thread exits. A pooled arena just loses a thread; a thread's own arena is kept with
+ * all its bins for the next thread that starts.
+ */
+void
+leave_arena(void *arg) {
+    bins_list *bins = arg;
+    if (pool_size > 0) {
+        __atomic_sub_fetch(&bins->thread_count, 1, __ATOMIC_RELAXED);
+    } else {
+        timed_lock(&mutex, LOCK_ARENA);
+        bins->next_idle = idle_arenas;
+        idle_arenas = bins;
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+/**
+ * Prints the stats at exit if stats is on by then, so that opt_mallctl can turn it on or off.
+ */
+void
+print_stats_at_exit() {
+    if (CONF(stats)) {
+        opt_printstats();
+    }
+}
+
+void
+read_config() {
+    load_conf();
+    init_spans();
+    init_profile();
+    per_cpu = opt_config.percpu;
+    if (per_cpu) {
+        init_caches();
+    }
+    if (opt_config.arenas >= 0 && !per_cpu) {
+        pool_size = opt_config.arenas;
+        if (pool_size <= 0) {
+            pool_size = 4 * get_nprocs();
+        }
+        pool = map_memory(pool_size * sizeof(bins_list *));
+        least_loaded = opt_config.arena_load;
+    }
+    pthread_key_create(&arena_key, leave_arena);
+    init_guard();
+    start_export();
+    atexit(print_stats_at_exit);
+}
+
+/**
+ * Reads the allocator configuration (see conf_t.c). percpu:true serves small chunks from per-CPU
+ * caches backed by one set of bins per CPU instead of one per thread, which bounds memory by core
+ * count when there are many more threads than cores. arenas:N shares a pool of N arenas between
+ * all threads instead (0 picks four per core), handed out round-robin or, with arena_load:load,
+ * to the arena with the fewest live threads.
+ */
+void
+init_config() {
+    pthread_once(&config_once, read_config);
+}
 
 /**
  * ================================================================
@@ -17,45 +108,123 @@ static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
  * ================================================================
  */
 
+/**
+ * Registers an arena so that opt_trim can find it. Pushes onto the front of the list with a
+ * compare-and-swap, so starting a thread never waits for a lock or walks the list.
+ */
 void
-init_arena() {
-    arena_list *a = arenas;
-    if (a == NULL) {
-        arenas = map_memory(sizeof(arena_list));
-        arenas->tid = pthread_self();
-        arenas->bins = bin_list;
-        arenas->next = NULL;
+init_arena(bins_list *bins) {
+    arena_list *a = meta_alloc(sizeof(arena_list));
+    a->tid = pthread_self();
+    a->bins = bins;
+    a->next = __atomic_load_n(&arenas, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&arenas, &a->next, a, true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Creates and registers an empty arena. Head bins are only made once a size is first used, so
+ * this is constant time and usually makes no syscall.
+ *
+ * @return the new list of bins
+ */
+bins_list
+*new_bins_list() {
+    bins_list *bins = meta_alloc(sizeof(bins_list));
+    init_arena(bins);
+    return bins;
+}
+
+/**
+ * Makes the first bin of a size class. Another thread sharing the arena may get there first, in
+ * which case its bin wins and ours goes back.
+ */
+bin_t
+*init_head(bins_list *bins, int size_class) {
+    bin_t *head = init_small_bin(size_class, pthread_self(), NULL);
+    bin_t *expected = NULL;
+    if (!__atomic_compare_exchange_n(&bins->bins[size_class], &expected, head, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        destroy_small_bin(head);
+        head = expected;
+    }
+    return head;
+}
+
+bin_t
+*get_head(bins_list *bins, int size_class) {
+    bin_t *head = __atomic_load_n(&bins->bins[size_class], __ATOMIC_ACQUIRE);
+    if (head == NULL) {
+        head = init_head(bins, size_class);
+    }
+    return head;
+}
+
+/**
+ * Assigns the calling thread to an arena of the pool, mapping the arena on first use. The arena's
+ * thread count drops again when the thread exits.
+ *
+ * @return the arena's list of bins
+ */
+bins_list
+*pick_arena() {
+    int ai = 0;
+    if (least_loaded) {
+        for (int ii = 0; ii < pool_size; ++ii) {
+            if (pool[ii] == NULL) {
+                ai = ii;
+                break;
+            }
+            if (pool[ii]->thread_count < pool[ai]->thread_count) {
+                ai = ii;
+            }
+        }
     } else {
-        while (a->next != NULL) {
-            a = a->next;
+        ai = (int) (__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % pool_size);
+    }
+    if (__atomic_load_n(&pool[ai], __ATOMIC_ACQUIRE) == NULL) {
+        timed_lock(&pool_mutex, LOCK_ARENA);
+        if (pool[ai] == NULL) {
+            __atomic_store_n(&pool[ai], new_bins_list(), __ATOMIC_RELEASE);
         }
-        arena_list *next_arena = map_memory(sizeof(arena_list));
-        next_arena->tid = pthread_self();
-        next_arena->bins = bin_list;
-        next_arena->next = NULL;
-        a->next = next_arena;
+        pthread_mutex_unlock(&pool_mutex);
     }
+    bins_list *bins = pool[ai];
+    __atomic_add_fetch(&bins->thread_count, 1, __ATOMIC_RELAXED);
+    pthread_setspecific(arena_key, bins);
+    return bins;
 }
 
 void
 init_bins() {
-    bin_list = map_memory(sizeof(bins_list));
-    pthread_mutex_lock(&mutex);
-    init_arena();
+    if (pool_size > 0) {
+        bin_list = pick_arena();
+        return;
+    }
+    timed_lock(&mutex, LOCK_ARENA);
+    bins_list *bins = idle_arenas;
+    if (bins != NULL) {
+        idle_arenas = bins->next_idle;
+    }
     pthread_mutex_unlock(&mutex);
-
-    for (int bi = 0; bi < NUM_OF_BIN_SIZES; ++bi) {
-        bin_t *bin = init_small_bin(BIN_SIZES[bi], pthread_self());
-        bin_list->bins[bi] = bin;
+    if (bins == NULL) {
+        bins = new_bins_list();
     }
+    pthread_setspecific(arena_key, bins);
+    bin_list = bins;
 }
 
+/**
+ * Finds the bin a chunk belongs to. Bins can span several pages and keep no header in them, so this
+ * goes through the page map rather than masking the address.
+ *
+ * @param item a chunk returned by opt_malloc
+ * @return its bin, or NULL if opt_malloc did not return it
+ */
 bin_t
 *get_bin(void *item) {
-    long mem = (long) item;
-    mem = mem >> 12; // Shift right 12 bits (e.g. 0xBFD4C231 --> 0xBFD4C)
-    mem = mem << 12; // Shift left 12 bits (e.g. 0xBFD4C --> 0xBFD4C000)
-    return (bin_t *) mem;
+    return pagemap_get(item);
 }
 
 /**
@@ -64,74 +233,119 @@ bin_t
  * ================================================================
  */
 
-bin_t
-*get_bin_from_size(size_t bytes, bins_list *list) {
-    for (int ii = 0; ii < NUM_OF_BIN_SIZES; ++ii) {
-        // Since the bytes list is sorted from lowest to highest, this will short circuit on the
-        // first available bin
-        if (bytes <= list->bins[ii]->bin_size) {
-            return list->bins[ii];
-        }
-    }
-    return NULL;
+int
+get_size_class(size_t bytes) {
+    return size_class_of(bytes);
 }
 
 void
 *opt_malloc(size_t bytes) {
+    init_config();
+    int size_class = get_size_class(bytes);
+    if (size_class == -1) {
+        return init_large_bin(bytes, pthread_self())->memory;
+    }
+    if (profile_sample()) {
+        profile_record(bytes);
+    }
+    if (guard_sample()) {
+        void *memory = guard_malloc(bytes);
+        if (memory != NULL) {
+            return memory;
+        }
+    }
+    if (per_cpu) {
+        return cache_malloc(size_class);
+    }
     if (bin_list == NULL) {
         init_bins();
     }
-    bin_t *bin = get_bin_from_size(bytes, bin_list);
-    if (bin != NULL) {
-        return get_memory(bin);
-    } else {
-        bin = init_large_bin(bytes, pthread_self());
-        return (void *) bin + sizeof(bin_t);
+    return get_memory(get_head(bin_list, size_class), size_class);
+}
+
+/**
+ * Allocates like opt_malloc, but places the chunk as close as it can to an existing one so that
+ * linked structures built one node at a time stay on the same pages: in the hint's bin first, then
+ * in a bin of this thread's arena on the surrounding pages of the same span, and only then wherever
+ * opt_malloc would. Chunks from per-CPU caches have no fixed place, so hints are ignored there.
+ *
+ * @param bytes size of the chunk
+ * @param hint a chunk returned by this allocator, or NULL
+ * @return pointer to the chunk
+ */
+void
+*opt_malloc_near(size_t bytes, void *hint) {
+    init_config();
+    int size_class = get_size_class(bytes);
+    if (hint == NULL || size_class == -1 || per_cpu) {
+        return opt_malloc(bytes);
+    }
+    if (bin_list == NULL) {
+        init_bins();
     }
+    bin_t *head = get_head(bin_list, size_class);
+    void *memory = get_memory_near(head, hint);
+    return memory != NULL ? memory : get_memory(head, size_class);
 }
 
-bins_list
-*get_bins_list(bin_t *bin) {
-    pthread_t tid = pthread_self();
-    if (tid == bin->tid) {
-        return bin_list;
-    } else {
-        arena_list *a = arenas;
-        tid = a->tid;
-        while (tid != bin->tid) {
-            a = a->next;
-            tid = a->tid;
-        }
-        return a->bins;
+void
+free_small_item(bin_t *bin, void *item) {
+    free_small_chunk(bin, item);
+}
+
+/**
+ * Tells whether a chunk belongs to a chain of another arena than the calling thread's. Chunks too
+ * small to hold a link are always freed in place.
+ */
+bool
+is_remote(bin_t *bin) {
+    if (bin->bin_size < sizeof(void *)) {
+        return false;
+    }
+    if (bin_list == NULL) {
+        return true;
     }
+    return __atomic_load_n(&bin_list->bins[bin->size_class], __ATOMIC_RELAXED) != bin->head;
 }
 
 void
 opt_free(void *item) {
     bin_t *bin = get_bin(item);
+    if (bin == NULL) {
+        if (guard_owns(item)) {
+            guard_free(item);
+        }
+        return;
+    }
     if (bin->is_large) {
         free_large_bin(bin);
+    } else if (per_cpu) {
+        cache_free(item, bin);
+    } else if (is_remote(bin)) {
+        remote_free(bin, item);
     } else {
-        size_t offset = item - (void *) bin - sizeof(bin_t);
-        int index_of_alloc = (int) (offset / bin->bin_size);
-        pthread_mutex_lock(&mutex);
-        bins_list *thread_bins = get_bins_list(bin);
-        bin_t *head = get_bin_from_size(bin->bin_size, thread_bins);
-        pthread_mutex_unlock(&mutex);
-        free_small_bin(bin, index_of_alloc, head);
+        free_small_item(bin, item);
     }
 }
 
 void
 *opt_realloc(void *prev, size_t bytes) {
+    if (prev == NULL) {
+        return opt_malloc(bytes);
+    }
     if (bytes == 0) {
         opt_free(prev);
         return prev;
     }
     void *alloc = opt_malloc(bytes);
     bin_t *b = get_bin(prev);
-    // Allocation size of given previous
-    size_t prev_size = b->is_large ? b->size_large : b->bin_size;
+    // Allocation size of given previous; a pointer that is not ours has nothing to copy
+    size_t prev_size = 0;
+    if (b != NULL) {
+        prev_size = b->is_large ? b->size_large : b->bin_size;
+    } else if (guard_owns(prev)) {
+        prev_size = guard_size(prev);
+    }
     if (prev_size < bytes) {
         memcpy(alloc, prev, prev_size);
         opt_free(prev);
@@ -140,4 +354,254 @@ void
         opt_free(alloc);
         return prev;
     }
-}
\ No newline at end of file
+}
+
+/**
+ * ================================================================
+ * Trimming
+ * ================================================================
+ */
+
+/**
+ * Gives retained memory back to the OS, like malloc_trim. Retired chunks that have become safe are
+ * freed, per-CPU caches and the calling thread's remote-free buffers are flushed, and empty bins
+ * of every arena are released first, then the page cache is emptied down to pad bytes. Only
+ * trylocks are taken on bins, so threads that are allocating at the same time are never blocked by
+ * a trim.
+ *
+ * @param pad bytes of empty pages to keep for upcoming allocations
+ * @return the number of bytes given back
+ */
+size_t
+opt_trim(size_t pad) {
+    // First, since the chunks it frees can go into the caches
+    reclaim_deferred();
+    flush_caches();
+    flush_remote_buffers();
+    // Arenas are only ever pushed onto the front, so the list can be walked without a lock
+    arena_list *a = __atomic_load_n(&arenas, __ATOMIC_ACQUIRE);
+    while (a != NULL) {
+        for (int bi = 0; bi < NUM_OF_BIN_SIZES; ++bi) {
+            bin_t *head = __atomic_load_n(&a->bins->bins[bi], __ATOMIC_ACQUIRE);
+            if (head != NULL) {
+                release_empty_bins(head);
+            }
+        }
+        a = a->next;
+    }
+    return span_trim(pad);
+}
+
+/**
+ * ================================================================
+ * Stats
+ * ================================================================
+ */
+
+/**
+ * Prints, for every size class in use, the bytes handed out against the bytes of the bins holding
+ * them, summed over all arenas.
+ */
+void
+print_class_usage() {
+    size_t total_live = 0;
+    size_t total_mapped = 0;
+    fprintf(stderr, "Class    Live kB  Mapped kB  Used\n");
+    for (int bi = 0; bi < NUM_OF_BIN_SIZES; ++bi) {
+        size_t live = 0;
+        size_t mapped = 0;
+        for (arena_list *a = __atomic_load_n(&arenas, __ATOMIC_ACQUIRE); a != NULL; a = a->next) {
+            bin_t *head = __atomic_load_n(&a->bins->bins[bi], __ATOMIC_ACQUIRE);
+            if (head != NULL) {
+                get_bin_usage(head, &live, &mapped);
+            }
+        }
+        if (mapped > 0) {
+            fprintf(stderr, "%5u %10zu %10zu  %3zu%%\n", class_table[bi].size, live / 1024,
+                    mapped / 1024, live * 100 / mapped);
+        }
+        total_live += live;
+        total_mapped += mapped;
+    }
+    if (total_mapped > 0) {
+        fprintf(stderr, "Total %10zu %10zu  %3zu%%\n", total_live / 1024, total_mapped / 1024,
+                total_live * 100 / total_mapped);
+    }
+}
+
+/**
+ * Takes a snapshot of the allocator for the stats file. The span and arena locks are taken one at
+ * a time and only briefly; chain heads are only trylocked, so an allocating thread is never made
+ * to wait for one.
+ *
+ * @param es zeroed snapshot to fill in
+ */
+void
+fill_export_stats(export_stats *es) {
+    span_stats ss;
+    span_getcounters(&ss);
+    es->spans_mapped = ss.spans_mapped;
+    es->span_bytes = ss.span_bytes;
+    es->pages_active = ss.pages_active;
+    es->pages_dirty = ss.pages_dirty;
+    es->pages_muzzy = ss.pages_muzzy;
+    es->pages_purged = ss.pages_purged;
+    es->pages_unmapped = ss.pages_unmapped;
+    es->extents_cached = ss.extents_cached;
+    es->large_bytes = ss.large_bytes;
+
+    for (arena_list *a = __atomic_load_n(&arenas, __ATOMIC_ACQUIRE); a != NULL; a = a->next) {
+        es->arenas += 1;
+    }
+    timed_lock(&mutex, LOCK_ARENA);
+    for (bins_list *bins = idle_arenas; bins != NULL; bins = bins->next_idle) {
+        es->idle_arenas += 1;
+    }
+    pthread_mutex_unlock(&mutex);
+    size_t cached_bytes = 0;
+    es->cached_chunks = cached_chunks(&cached_bytes);
+    es->cached_bytes = (long) cached_bytes;
+
+    for (int ii = 0; ii < LOCK_CLASSES; ++ii) {
+        lock_stats *ls = lock_getstats(ii);
+        es->lock_waits += __atomic_load_n(&ls->contended, __ATOMIC_RELAXED);
+        es->lock_wait_ns += __atomic_load_n(&ls->wait_ns, __ATOMIC_RELAXED);
+        es->trylock_failed += __atomic_load_n(&ls->trylock_failed, __ATOMIC_RELAXED);
+    }
+
+    es->nclasses = NUM_OF_BIN_SIZES;
+    for (int bi = 0; bi < NUM_OF_BIN_SIZES; ++bi) {
+        size_t live = 0;
+        size_t mapped = 0;
+        for (arena_list *a = __atomic_load_n(&arenas, __ATOMIC_ACQUIRE); a != NULL; a = a->next) {
+            bin_t *head = __atomic_load_n(&a->bins->bins[bi], __ATOMIC_ACQUIRE);
+            if (head != NULL) {
+                peek_bin_usage(head, &live, &mapped);
+            }
+        }
+        es->classes[bi].size = (long) class_table[bi].size;
+        es->classes[bi].live_bytes = (long) live;
+        es->classes[bi].mapped_bytes = (long) mapped;
+    }
+}
+
+/**
+ * ================================================================
+ * Heap walk
+ * ================================================================
+ */
+
+/**
+ * Calls fn once for every size class of every arena that has bins, then once for all large chunks
+ * if there are any. Safe to call from any thread while others allocate and free: arenas are never
+ * taken off their list, and each chain is only held for as long as it takes to count it, so the
+ * classes are not a snapshot of one instant. Arenas are numbered by their position in the walk,
+ * newest first.
+ *
+ * @param fn called with each class, which is only valid during the call
+ * @param arg passed on to fn
+ */
+void
+opt_heap_walk(heap_walk_fn fn, void *arg) {
+    int ai = 0;
+    for (arena_list *a = __atomic_load_n(&arenas, __ATOMIC_ACQUIRE); a != NULL; a = a->next) {
+        for (int bi = 0; bi < NUM_OF_BIN_SIZES; ++bi) {
+            bin_t *head = __atomic_load_n(&a->bins->bins[bi], __ATOMIC_ACQUIRE);
+            if (head != NULL) {
+                heap_class hc = {.arena = ai, .size_class = bi,
+                                 .chunk_size = class_table[bi].size};
+                walk_chain(head, &hc);
+                fn(&hc, arg);
+            }
+        }
+        ai += 1;
+    }
+    span_stats ss;
+    span_getcounters(&ss);
+    if (ss.large_objects > 0) {
+        heap_class hc = {.arena = -1, .size_class = -1};
+        hc.live_chunks = ss.large_objects;
+        hc.overhead_bytes = ss.large_objects * sizeof(bin_t);
+        hc.mapped_bytes = (size_t) ss.large_bytes;
+        fn(&hc, arg);
+    }
+}
+
+typedef struct heap_totals {
+    size_t live_bytes;
+    size_t free_bytes;
+    size_t overhead_bytes;
+    size_t slack_bytes;
+    size_t mapped_bytes;
+} heap_totals;
+
+void
+report_class(const heap_class *hc, void *arg) {
+    heap_totals *t = arg;
+    size_t live = hc->live_chunks * hc->chunk_size;
+    size_t free = hc->free_chunks * hc->chunk_size;
+    if (hc->size_class == -1) {
+        live = hc->mapped_bytes;
+        fprintf(stderr, "Large %6ld chunks %28zu\n", hc->live_chunks, hc->mapped_bytes / 1024);
+    } else {
+        fprintf(stderr, "%5d %5zu %6ld %7ld %7ld %10zu  %3zu%%\n", hc->arena, hc->chunk_size,
+                hc->bins, hc->live_chunks, hc->free_chunks, hc->mapped_bytes / 1024,
+                hc->mapped_bytes > 0 ? free * 100 / hc->mapped_bytes : 0);
+    }
+    t->live_bytes += live;
+    t->free_bytes += free;
+    t->overhead_bytes += hc->overhead_bytes;
+    t->slack_bytes += hc->slack_bytes;
+    t->mapped_bytes += hc->mapped_bytes;
+}
+
+/**
+ * Walks the heap and prints what every arena holds per size class, with the share of each class's
+ * pages that is free chunks. Below that, internal fragmentation is the descriptors and bin slack
+ * against everything the heap takes up, and external fragmentation is the free chunks against
+ * the pages mapped. Request sizes are not kept, so rounding up to a class is not counted.
+ */
+void
+opt_heap_report() {
+    heap_totals t = {0};
+    fprintf(stderr, "\n== opt malloc heap ==\n");
+    fprintf(stderr, "Arena Class   Bins    Live    Free  Mapped kB  Free\n");
+    opt_heap_walk(report_class, &t);
+    size_t footprint = t.mapped_bytes + t.overhead_bytes;
+    fprintf(stderr, "Live:     %zu kB\n", t.live_bytes / 1024);
+    fprintf(stderr, "Free:     %zu kB\n", t.free_bytes / 1024);
+    fprintf(stderr, "Overhead: %zu kB descriptors, %zu kB slack\n", t.overhead_bytes / 1024,
+            t.slack_bytes / 1024);
+    if (footprint > 0) {
+        fprintf(stderr, "Internal: %.1f%%\n",
+                (t.overhead_bytes + t.slack_bytes) * 100.0 / footprint);
+        fprintf(stderr, "External: %.1f%%\n", t.free_bytes * 100.0 / t.mapped_bytes);
+    }
+}
+
+void
+opt_printstats() {
+    span_stats ss;
+    span_getstats(&ss);
+    long span_bytes = spans_enabled() ? ss.span_bytes : 0;
+    fprintf(stderr, "\n== opt malloc stats ==\n");
+    print_conf();
+    fprintf(stderr, "Spans:    %ld\n", ss.spans_mapped);
+    fprintf(stderr, "Carved:   %ld\n", ss.pages_carved);
+    fprintf(stderr, "Reused:   %ld\n", ss.pages_reused);
+    fprintf(stderr, "Active:   %ld\n", ss.pages_active);
+    fprintf(stderr, "Dirty:    %ld\n", ss.pages_dirty);
+    fprintf(stderr, "Muzzy:    %ld\n", ss.pages_muzzy);
+    fprintf(stderr, "Purged:   %ld\n", ss.pages_purged);
+    fprintf(stderr, "Unmapped: %ld\n", ss.pages_unmapped);
+    fprintf(stderr, "Extents:  %ld cached, %ld reused\n", ss.extents_cached, ss.extents_reused);
+    fprintf(stderr, "THP:      %ld kB\n", ss.thp_bytes / 1024);
+    if (span_bytes > 0) {
+        long coverage = ss.thp_bytes > span_bytes ? 100 : ss.thp_bytes * 100 / span_bytes;
+        fprintf(stderr, "Coverage: %ld%%\n", coverage);
+    }
+    print_class_usage();
+    print_profile_stats();
+    print_guard_stats();
+    print_lock_stats();
+}
@@ -3,13 +3,15 @@
 
 #include <stddef.h>
 #include "bin_t.h"
-
-#define NUM_OF_BIN_SIZES 19
-static size_t BIN_SIZES[NUM_OF_BIN_SIZES] = {4, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384,
-                                             512, 768, 1024, 1536, 2048, 3072};
+#include "size_class.h"
+#include "conf_t.h"
 
 typedef struct bins_list {
     bin_t *bins[NUM_OF_BIN_SIZES];
+    // Threads assigned to this list when arenas are pooled
+    int thread_count;
+    // Next arena waiting for a new thread, once this one's thread has exited
+    struct bins_list *next_idle;
 } bins_list;
 
 typedef struct arena_list {
@@ -18,10 +20,32 @@ typedef struct arena_list {
     struct arena_list *next;
 } arena_list;
 
+bins_list *new_bins_list();
+
+bin_t *get_head(bins_list *bins, int size_class);
+
+bin_t *get_bin(void *item);
+
+int get_size_class(size_t bytes);
+
+void free_small_item(bin_t *bin, void *item);
+
 void *opt_malloc(size_t bytes);
 
+void *opt_malloc_near(size_t bytes, void *hint);
+
 void opt_free(void *item);
 
 void *opt_realloc(void *prev, size_t bytes);
 
+size_t opt_trim(size_t pad);
+
+void opt_printstats();
+
+typedef void (*heap_walk_fn)(const heap_class *hc, void *arg);
+
+void opt_heap_walk(heap_walk_fn fn, void *arg);
+
+void opt_heap_report();
+
 #endif //CS3650_OPT_MALLOC_H
@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include <sys/mman.h>
+#include "bin_t.h"
+#include "pagemap_t.h"
+
+typedef struct pagemap_leaf {
+    bin_t *bins[PAGEMAP_FANOUT];
+} pagemap_leaf;
+
+typedef struct pagemap_node {
+    pagemap_leaf *leaves[PAGEMAP_FANOUT];
+} pagemap_node;
+
+// Top level of the map; the lower levels are mapped as addresses show up in them
+static pagemap_node *root[PAGEMAP_FANOUT];
+
+/**
+ * Installs a lower level of the map if no other thread has yet. Whoever loses the race unmaps its
+ * copy and uses the winner's.
+ *
+ * @param slot where the level goes
+ * @param size size of the level
+ * @return the level now in the slot
+ */
+void
+*install_level(void **slot, size_t size) {
+    void *level = map_memory(size);
+    void *expected = NULL;
+    if (!__atomic_compare_exchange_n(slot, &expected, level, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        munmap(level, size);
+        return expected;
+    }
+    return level;
+}
+
+/**
+ * Points every page of the given range at a bin, or at NULL to forget the range. Lookups never
+ * take a lock, so the entries are published with release stores.
+ *
+ * @param addr page-aligned start of the range
+ * @param size length of the range in bytes
+ * @param bin the bin that owns the range
+ */
+void
+pagemap_set(void *addr, size_t size, bin_t *bin) {
+    for (uintptr_t page = (uintptr_t) addr >> 12; page < ((uintptr_t) addr + size) >> 12; ++page) {
+        size_t ri = (page >> (2 * PAGEMAP_BITS)) & (PAGEMAP_FANOUT - 1);
+        size_t ni = (page >> PAGEMAP_BITS) & (PAGEMAP_FANOUT - 1);
+        size_t li = page & (PAGEMAP_FANOUT - 1);
+        pagemap_node *node = __atomic_load_n(&root[ri], __ATOMIC_ACQUIRE);
+        if (node == NULL) {
+            node = install_level((void **) &root[ri], sizeof(pagemap_node));
+        }
+        pagemap_leaf *leaf = __atomic_load_n(&node->leaves[ni], __ATOMIC_ACQUIRE);
+        if (leaf == NULL) {
+            leaf = install_level((void **) &node->leaves[ni], sizeof(pagemap_leaf));
+        }
+        __atomic_store_n(&leaf->bins[li], bin, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Finds the bin that owns an address.
+ *
+ * @param addr any address inside a registered page
+ * @return the bin, or NULL if the page does not belong to the allocator
+ */
+bin_t
+*pagemap_get(void *addr) {
+    uintptr_t page = (uintptr_t) addr >> 12;
+    pagemap_node *node = __atomic_load_n(&root[(page >> (2 * PAGEMAP_BITS)) & (PAGEMAP_FANOUT - 1)],
+                                         __ATOMIC_ACQUIRE);
+    if (node == NULL) {
+        return NULL;
+    }
+    pagemap_leaf *leaf = __atomic_load_n(&node->leaves[(page >> PAGEMAP_BITS) & (PAGEMAP_FANOUT - 1)],
+                                         __ATOMIC_ACQUIRE);
+    if (leaf == NULL) {
+        return NULL;
+    }
+    return __atomic_load_n(&leaf->bins[page & (PAGEMAP_FANOUT - 1)], __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,15 @@
+#ifndef CS3650_PAGEMAP_T_H
+#define CS3650_PAGEMAP_T_H
+
+#include <stddef.h>
+#include "bin_t.h"
+
+// Three levels of 12 bits each cover the 48-bit address space in 4 KiB pages
+#define PAGEMAP_BITS 12
+#define PAGEMAP_FANOUT (1 << PAGEMAP_BITS)
+
+void pagemap_set(void *addr, size_t size, bin_t *bin);
+
+bin_t *pagemap_get(void *addr);
+
+#endif //CS3650_PAGEMAP_T_H
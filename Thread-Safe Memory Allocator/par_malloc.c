@@ -1,23 +1,13 @@
-
-
 #include <stdlib.h>
 #include <unistd.h>
 
 #include "xmalloc.h"
 #include "opt_malloc.h"
 
-void *
-xmalloc(size_t bytes) {
-    return opt_malloc(bytes);
-}
-
-void
-xfree(void *ptr) {
-    opt_free(ptr);
-}
+static xmalloc_backend par_backend = {"par", 2, opt_malloc, opt_free, opt_realloc};
 
-void *
-xrealloc(void *prev, size_t bytes) {
-    return opt_realloc(prev, bytes);
+__attribute__((constructor))
+static void
+register_par() {
+    xmalloc_register(&par_backend);
 }
-
@@ -0,0 +1,571 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bin_t.h"
+#include "pheap_t.h"
+
+// Smallest heap worth making: the header, its map and descriptors, and a few bins
+#define PHEAP_MIN_SIZE (64 * PAGE_SIZE)
+
+// Pages taken by the header
+#define HEADER_PAGES ((sizeof(pheap) + PAGE_SIZE - 1) / PAGE_SIZE)
+
+#define CLASS_INFO(ci, size, pages) {size, CLASS_MAGIC(size), CLASS_ITEMS(size, pages), pages},
+static const class_info default_classes[NUM_OF_BIN_SIZES] = {SIZE_CLASSES(CLASS_INFO)};
+
+// This process's owner slot in the shared heap it last used; forgotten in a forked child
+static pheap *owner_heap = NULL;
+static int owner_id = -1;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+/**
+ * ================================================================
+ * Layout
+ * ================================================================
+ */
+
+uint32_t
+*page_map(pheap *heap) {
+    return (uint32_t *) ((char *) heap + HEADER_PAGES * PAGE_SIZE);
+}
+
+prun
+*run_at(pheap *heap, uint32_t first) {
+    size_t map_pages = ((size_t) heap->pages * sizeof(uint32_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    return (prun *) ((char *) heap + (HEADER_PAGES + map_pages) * PAGE_SIZE) + first;
+}
+
+char
+*page_at(pheap *heap, uint32_t page) {
+    return (char *) heap + (size_t) page * PAGE_SIZE;
+}
+
+/**
+ * Points the pages of a run at its first page. Runs in use have every page mapped, so that any
+ * pointer into them finds them; free runs only need their ends, which is all a neighbour looks at
+ * when it is freed.
+ */
+void
+map_run(pheap *heap, uint32_t first, uint32_t pages, bool all) {
+    uint32_t *map = page_map(heap);
+    map[first] = first;
+    map[first + pages - 1] = first;
+    for (uint32_t page = first + 1; all && page < first + pages - 1; ++page) {
+        map[page] = first;
+    }
+}
+
+void
+link_run(pheap *heap, uint32_t *list, uint32_t first) {
+    prun *run = run_at(heap, first);
+    run->prev = 0;
+    run->next = *list;
+    if (*list != 0) {
+        run_at(heap, *list)->prev = first;
+    }
+    *list = first;
+}
+
+void
+unlink_run(pheap *heap, uint32_t *list, uint32_t first) {
+    prun *run = run_at(heap, first);
+    if (run->prev != 0) {
+        run_at(heap, run->prev)->next = run->next;
+    } else {
+        *list = run->next;
+    }
+    if (run->next != 0) {
+        run_at(heap, run->next)->prev = run->prev;
+    }
+    run->next = 0;
+    run->prev = 0;
+}
+
+/**
+ * ================================================================
+ * Runs
+ * ================================================================
+ */
+
+/**
+ * Takes a run of pages: the first free run that is long enough, split if it is longer, or else
+ * fresh pages from the top of the heap. The new run is written before anything points to it, so
+ * a crash part way leaves runs that recover_heap can still walk. Must hold the heap's mutex.
+ *
+ * @return the first page of the run, or 0 if the heap is full
+ */
+uint32_t
+take_run(pheap *heap, uint32_t pages) {
+    for (uint32_t first = heap->free_runs; first != 0; first = run_at(heap, first)->next) {
+        prun *run = run_at(heap, first);
+        if (run->pages < pages) {
+            continue;
+        }
+        unlink_run(heap, &heap->free_runs, first);
+        if (run->pages > pages) {
+            uint32_t rest = first + pages;
+            prun *tail = run_at(heap, rest);
+            tail->size_class = PRUN_FREE;
+            tail->pages = run->pages - pages;
+            map_run(heap, rest, tail->pages, false);
+            link_run(heap, &heap->free_runs, rest);
+            run->pages = pages;
+        }
+        return first;
+    }
+    if (heap->pages - heap->top < pages) {
+        return 0;
+    }
+    uint32_t first = heap->top;
+    run_at(heap, first)->size_class = PRUN_FREE;
+    run_at(heap, first)->pages = pages;
+    heap->top += pages;
+    return first;
+}
+
+/**
+ * Gives back a run, merged with the free runs on either side of it. A free run that ends at the
+ * top of the heap goes back to the untouched pages. Must hold the heap's mutex.
+ */
+void
+give_run(pheap *heap, uint32_t first) {
+    prun *run = run_at(heap, first);
+    // Marked free before any merge, since a run absorbed into the one before keeps its descriptor
+    // and its page map entries, and a second free of it must not find it still in use
+    run->size_class = PRUN_FREE;
+    uint32_t next = first + run->pages;
+    if (next < heap->top && run_at(heap, next)->size_class == PRUN_FREE) {
+        unlink_run(heap, &heap->free_runs, next);
+        run->pages += run_at(heap, next)->pages;
+    }
+    if (first > heap->data_start) {
+        uint32_t before = page_map(heap)[first - 1];
+        prun *prev = run_at(heap, before);
+        if (prev->size_class == PRUN_FREE && before + prev->pages == first) {
+            unlink_run(heap, &heap->free_runs, before);
+            prev->pages += run->pages;
+            first = before;
+            run = prev;
+        }
+    }
+    run->size_class = PRUN_FREE;
+    if (first + run->pages == heap->top) {
+        heap->top = first;
+        return;
+    }
+    map_run(heap, first, run->pages, false);
+    link_run(heap, &heap->free_runs, first);
+}
+
+/**
+ * ================================================================
+ * Opening and closing
+ * ================================================================
+ */
+
+void
+init_heap(pheap *heap, size_t size) {
+    heap->magic = PHEAP_MAGIC;
+    heap->version = PHEAP_VERSION;
+    heap->page_size = PAGE_SIZE;
+    heap->size = size;
+    heap->pages = size / PAGE_SIZE;
+    size_t map_pages = ((size_t) heap->pages * sizeof(uint32_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t run_pages = ((size_t) heap->pages * sizeof(prun) + PAGE_SIZE - 1) / PAGE_SIZE;
+    heap->data_start = HEADER_PAGES + map_pages + run_pages;
+    heap->top = heap->data_start;
+    memcpy(heap->classes, default_classes, sizeof(default_classes));
+}
+
+/**
+ * Brings the lists back in line with the runs after the heap was not closed. Walks the runs once,
+ * counting each bin's chunks from its bitmap, so the cost is per bin rather than per object; the
+ * chunks themselves are never touched. Runs are always written before anything links to them, so
+ * the walk only ever sees whole runs. The same pass repairs a shared heap after a process died
+ * part way through changing it.
+ */
+void
+recover_heap(pheap *heap) {
+    memset(heap->partial, 0, sizeof(heap->partial));
+    heap->free_runs = 0;
+    uint32_t first = heap->data_start;
+    while (first < heap->top) {
+        prun *run = run_at(heap, first);
+        if (run->pages == 0 || run->pages > heap->top - first) {
+            fprintf(stderr, "pheap: damaged run at page %u, dropping the pages after it\n", first);
+            heap->top = first;
+            break;
+        }
+        int ci = run->size_class;
+        if (ci >= 0 && ci < NUM_OF_BIN_SIZES) {
+            run->count = count_set_bits(&run->bitmap, heap->classes[ci].max_items);
+            if (run->owner >= PHEAP_MAX_OWNERS) {
+                run->owner = 0;
+            }
+            if (run->count == 0) {
+                run->size_class = PRUN_FREE;
+            } else if (run->count < heap->classes[ci].max_items) {
+                link_run(heap, &heap->partial[run->owner][ci], first);
+            }
+        } else if (ci != PRUN_LARGE) {
+            run->size_class = PRUN_FREE;
+        }
+        if (run->size_class == PRUN_FREE) {
+            map_run(heap, first, run->pages, false);
+            link_run(heap, &heap->free_runs, first);
+        } else {
+            map_run(heap, first, run->pages, true);
+        }
+        first += run->pages;
+    }
+    heap->recovered = 1;
+}
+
+/**
+ * Sets up the heap's mutex. It is robust, so that the next process or thread to lock it after its
+ * holder died is told to repair the heap instead of waiting forever.
+ */
+void
+init_mutex(pheap *heap) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (heap->shared) {
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    }
+    pthread_mutex_init(&heap->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/**
+ * Locks the heap. If the last holder died with it locked, the runs may be half changed, so the
+ * lists are rebuilt from the runs before the heap is used again.
+ */
+void
+lock_heap(pheap *heap) {
+    if (pthread_mutex_lock(&heap->mutex) == EOWNERDEAD) {
+        recover_heap(heap);
+        heap->recoveries += 1;
+        pthread_mutex_consistent(&heap->mutex);
+    }
+}
+
+/**
+ * Opens a persistent heap kept in a file, making the file if it does not exist. The whole file is
+ * mapped shared, so every allocation and free goes straight to the page cache and survives the
+ * process; pages that were never used take no disk. An existing heap is ready as soon as it is
+ * mapped. If it was not closed, its bins are first recounted from their bitmaps.
+ *
+ * @param path the heap file
+ * @param size bytes the heap can hold if it is made now; an existing heap keeps its size
+ * @return the heap, which is also the start of the mapping, or NULL with errno set
+ */
+pheap
+*pheap_open(const char *path, size_t size) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+    bool fresh = st.st_size == 0;
+    if (fresh) {
+        size = size < PHEAP_MIN_SIZE ? PHEAP_MIN_SIZE : size & ~(size_t) (PAGE_SIZE - 1);
+        if (ftruncate(fd, size) == -1) {
+            close(fd);
+            return NULL;
+        }
+    } else {
+        size = st.st_size;
+    }
+    pheap *heap = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (heap == MAP_FAILED) {
+        return NULL;
+    }
+    if (fresh) {
+        init_heap(heap, size);
+    } else if (size < PHEAP_MIN_SIZE || heap->magic != PHEAP_MAGIC ||
+               heap->version != PHEAP_VERSION || heap->page_size != PAGE_SIZE ||
+               heap->size != size) {
+        munmap(heap, size);
+        errno = EINVAL;
+        return NULL;
+    }
+    heap->recovered = 0;
+    if (!fresh && !heap->clean) {
+        recover_heap(heap);
+    }
+    heap->opens += 1;
+    heap->shared = 0;
+    init_mutex(heap);
+    heap->clean = 0;
+    msync(heap, HEADER_PAGES * PAGE_SIZE, MS_SYNC);
+    return heap;
+}
+
+void
+forget_owner() {
+    owner_heap = NULL;
+    owner_id = -1;
+}
+
+void
+register_atfork() {
+    pthread_atfork(NULL, NULL, forget_owner);
+}
+
+/**
+ * Makes a heap to share between processes: create it before forking, and every child can
+ * allocate in it, free what any other process allocated, and hand objects to the others by
+ * offset. The heap is anonymous shared memory, so it goes away with the last process. Every
+ * process gets an owner slot with bins of its own, so what one process allocates stays together;
+ * the slot of a process that exits is taken over, bins and all, by the next process that needs
+ * one. A process killed while it held the heap's lock costs only a recovery pass in the next
+ * process to lock it.
+ *
+ * @param size bytes the heap can hold
+ * @return the heap, or NULL with errno set
+ */
+pheap
+*pheap_share(size_t size) {
+    size = size < PHEAP_MIN_SIZE ? PHEAP_MIN_SIZE : size & ~(size_t) (PAGE_SIZE - 1);
+    pheap *heap = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE,
+                       -1, 0);
+    if (heap == MAP_FAILED) {
+        return NULL;
+    }
+    init_heap(heap, size);
+    heap->shared = 1;
+    heap->opens = 1;
+    init_mutex(heap);
+    pthread_once(&atfork_once, register_atfork);
+    return heap;
+}
+
+/**
+ * Returns the calling process's owner slot, taking a free one or one whose process is gone if it
+ * has none yet. When every slot is in use, processes share slots, which only costs locality.
+ * Must hold the heap's mutex.
+ */
+int
+current_owner(pheap *heap) {
+    if (!heap->shared) {
+        return 0;
+    }
+    if (__atomic_load_n(&owner_heap, __ATOMIC_RELAXED) == heap) {
+        return __atomic_load_n(&owner_id, __ATOMIC_RELAXED);
+    }
+    pid_t pid = getpid();
+    int id = -1;
+    for (int ii = 0; ii < PHEAP_MAX_OWNERS && id == -1; ++ii) {
+        if (heap->owners[ii] == pid) {
+            id = ii;
+        }
+    }
+    for (int ii = 0; ii < PHEAP_MAX_OWNERS && id == -1; ++ii) {
+        if (heap->owners[ii] == 0 || (kill(heap->owners[ii], 0) == -1 && errno == ESRCH)) {
+            heap->owners[ii] = pid;
+            id = ii;
+        }
+    }
+    if (id == -1) {
+        id = pid % PHEAP_MAX_OWNERS;
+    }
+    __atomic_store_n(&owner_id, id, __ATOMIC_RELAXED);
+    __atomic_store_n(&owner_heap, heap, __ATOMIC_RELAXED);
+    return id;
+}
+
+/**
+ * Returns the calling process's owner slot in a shared heap, 0 in a heap that is not shared.
+ */
+int
+pheap_owner_id(pheap *heap) {
+    lock_heap(heap);
+    int id = current_owner(heap);
+    pthread_mutex_unlock(&heap->mutex);
+    return id;
+}
+
+/**
+ * Writes everything a heap kept in a file holds to the file.
+ */
+void
+pheap_sync(pheap *heap) {
+    lock_heap(heap);
+    check_rv(msync(heap, heap->size, MS_SYNC));
+    pthread_mutex_unlock(&heap->mutex);
+}
+
+/**
+ * Closes a heap, marking it clean once everything in it is on disk so that the next open needs
+ * no recovery. Nothing in this process may use the heap afterwards. A shared heap is only unmapped
+ * from the calling process; the others carry on.
+ */
+void
+pheap_close(pheap *heap) {
+    if (heap->shared) {
+        if (__atomic_load_n(&owner_heap, __ATOMIC_RELAXED) == heap) {
+            forget_owner();
+        }
+        munmap(heap, heap->size);
+        return;
+    }
+    lock_heap(heap);
+    check_rv(msync(heap, heap->size, MS_SYNC));
+    heap->clean = 1;
+    check_rv(msync(heap, HEADER_PAGES * PAGE_SIZE, MS_SYNC));
+    pthread_mutex_unlock(&heap->mutex);
+    pthread_mutex_destroy(&heap->mutex);
+    munmap(heap, heap->size);
+}
+
+/**
+ * ================================================================
+ * Allocation
+ * ================================================================
+ */
+
+int
+pheap_class_of(pheap *heap, size_t bytes) {
+    for (int ci = 0; ci < NUM_OF_BIN_SIZES; ++ci) {
+        if (bytes <= heap->classes[ci].size) {
+            return ci;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Allocates a chunk in a persistent heap. Small chunks come from bins laid out like the par
+ * allocator's, with a bitmap per bin; larger ones get a run of pages of their own.
+ *
+ * @return the chunk, or NULL if the heap is full
+ */
+void
+*pheap_alloc(pheap *heap, size_t bytes) {
+    int ci = pheap_class_of(heap, bytes);
+    lock_heap(heap);
+    void *item = NULL;
+    if (ci == -1) {
+        uint32_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint32_t first = take_run(heap, pages);
+        if (first != 0) {
+            prun *run = run_at(heap, first);
+            run->count = 1;
+            map_run(heap, first, pages, true);
+            run->size_class = PRUN_LARGE;
+            item = page_at(heap, first);
+        }
+        pthread_mutex_unlock(&heap->mutex);
+        return item;
+    }
+    class_info *cls = &heap->classes[ci];
+    int owner = current_owner(heap);
+    uint32_t *partial = &heap->partial[owner][ci];
+    uint32_t first = *partial;
+    if (first == 0) {
+        first = take_run(heap, cls->pages);
+        if (first == 0) {
+            pthread_mutex_unlock(&heap->mutex);
+            return NULL;
+        }
+        prun *run = run_at(heap, first);
+        init_bitmap(&run->bitmap);
+        run->count = 0;
+        run->owner = owner;
+        map_run(heap, first, cls->pages, true);
+        run->size_class = ci;
+        link_run(heap, partial, first);
+    }
+    prun *run = run_at(heap, first);
+    int idx = get_first_empty_bit(&run->bitmap, cls->max_items);
+    set_nth_bit(&run->bitmap, idx);
+    run->count += 1;
+    if (run->count == cls->max_items) {
+        unlink_run(heap, partial, first);
+    }
+    item = page_at(heap, first) + (size_t) idx * cls->size;
+    pthread_mutex_unlock(&heap->mutex);
+    return item;
+}
+
+void __attribute__((noreturn))
+pheap_invalid(pheap *heap, void *item) {
+    pthread_mutex_unlock(&heap->mutex);
+    fprintf(stderr, "pheap: invalid or double free of %p\n", item);
+    abort();
+}
+
+/**
+ * Frees a chunk of a persistent heap. A bin that empties is given back as free pages. A pointer
+ * that is found not to be a live chunk, such as one freed twice, aborts the process.
+ */
+void
+pheap_free(pheap *heap, void *item) {
+    if (item == NULL) {
+        return;
+    }
+    uint64_t offset = pheap_offset(heap, item);
+    lock_heap(heap);
+    if (offset < (uint64_t) heap->data_start * PAGE_SIZE ||
+        offset >= (uint64_t) heap->top * PAGE_SIZE) {
+        pheap_invalid(heap, item);
+    }
+    uint32_t first = page_map(heap)[offset / PAGE_SIZE];
+    if (first < heap->data_start || first > offset / PAGE_SIZE) {
+        pheap_invalid(heap, item);
+    }
+    prun *run = run_at(heap, first);
+    size_t rel = offset - (uint64_t) first * PAGE_SIZE;
+    if (rel >= (size_t) run->pages * PAGE_SIZE) {
+        pheap_invalid(heap, item);
+    }
+    if (run->size_class == PRUN_LARGE && rel == 0) {
+        give_run(heap, first);
+        pthread_mutex_unlock(&heap->mutex);
+        return;
+    }
+    if (run->size_class < 0 || run->size_class >= NUM_OF_BIN_SIZES) {
+        pheap_invalid(heap, item);
+    }
+    class_info *cls = &heap->classes[run->size_class];
+    int idx = chunk_index(rel, cls->magic);
+    if ((size_t) idx * cls->size != rel || idx >= cls->max_items ||
+        !get_nth_bit(&run->bitmap, idx)) {
+        pheap_invalid(heap, item);
+    }
+    clear_nth_bit(&run->bitmap, idx);
+    if (run->count == cls->max_items) {
+        link_run(heap, &heap->partial[run->owner][run->size_class], first);
+    }
+    run->count -= 1;
+    if (run->count == 0) {
+        unlink_run(heap, &heap->partial[run->owner][run->size_class], first);
+        give_run(heap, first);
+    }
+    pthread_mutex_unlock(&heap->mutex);
+}
+
+/**
+ * Returns the object the heap's data is reached from, as last set by pheap_set_root, or NULL.
+ */
+void
+*pheap_root(pheap *heap) {
+    return pheap_pointer(heap, __atomic_load_n(&heap->root, __ATOMIC_ACQUIRE));
+}
+
+void
+pheap_set_root(pheap *heap, void *item) {
+    __atomic_store_n(&heap->root, pheap_offset(heap, item), __ATOMIC_RELEASE);
+}
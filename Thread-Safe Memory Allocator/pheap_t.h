@@ -0,0 +1,105 @@
+#ifndef CS3650_PHEAP_T_H
+#define CS3650_PHEAP_T_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "bitmap_t.h"
+#include "size_class.h"
+
+#define PHEAP_MAGIC 0x3130765041454850UL
+#define PHEAP_VERSION 2
+// Processes that can have bins of their own in a shared heap; more than this share them
+#define PHEAP_MAX_OWNERS 32
+
+// A run of pages in a persistent heap: a bin of one size class, one large chunk, or free pages.
+// Runs are found by their first page, and link to each other by first page, so nothing in the
+// file depends on where it is mapped.
+typedef struct prun {
+    bitmap_t bitmap;
+    // A size class, or PRUN_LARGE or PRUN_FREE
+    int32_t size_class;
+    uint32_t pages;
+    int32_t count;
+    // The process whose lists a bin is on in a shared heap
+    uint32_t owner;
+    uint32_t next;
+    uint32_t prev;
+} prun;
+
+#define PRUN_LARGE (-1)
+#define PRUN_FREE (-2)
+
+// The first pages of a persistent heap file. They are followed by the page map, which gives the
+// first page of the run every page belongs to, then a run descriptor for every page, then the
+// pages.
+typedef struct pheap {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint64_t size;
+    uint32_t pages;
+    uint32_t data_start;
+    // Pages from here to the end of the file have never been used
+    uint32_t top;
+    // Set by pheap_close, and cleared while the heap is open
+    uint32_t clean;
+    // Offset of the object the heap's data is reached from
+    uint64_t root;
+    // The classes the heap was made with, which stay the same even if the defaults change
+    class_info classes[NUM_OF_BIN_SIZES];
+    // First page of a free run, and of a bin of each class with room for each owner; 0 for none
+    uint32_t free_runs;
+    uint32_t partial[PHEAP_MAX_OWNERS][NUM_OF_BIN_SIZES];
+    // Whether this open had to recover from a heap that was not closed
+    uint32_t recovered;
+    // Whether the heap is shared between processes, and how often one died holding its lock
+    uint32_t shared;
+    uint64_t recoveries;
+    uint64_t opens;
+    // The process in each owner slot of a shared heap, or 0 for a free slot
+    int32_t owners[PHEAP_MAX_OWNERS];
+    pthread_mutex_t mutex;
+} pheap;
+
+pheap *pheap_open(const char *path, size_t size);
+
+pheap *pheap_share(size_t size);
+
+int pheap_owner_id(pheap *heap);
+
+void pheap_close(pheap *heap);
+
+void pheap_sync(pheap *heap);
+
+void *pheap_alloc(pheap *heap, size_t bytes);
+
+void pheap_free(pheap *heap, void *item);
+
+void *pheap_root(pheap *heap);
+
+void pheap_set_root(pheap *heap, void *item);
+
+/**
+ * Turns a pointer into the heap into an offset that stays valid wherever the heap is mapped next.
+ * Objects in the heap should point at each other by offset.
+ *
+ * @return the offset, or 0 for NULL
+ */
+static inline uint64_t
+pheap_offset(pheap *heap, void *item) {
+    return item == NULL ? 0 : (uint64_t) ((char *) item - (char *) heap);
+}
+
+/**
+ * Turns an offset from pheap_offset back into a pointer.
+ *
+ * @return the pointer, or NULL for 0
+ */
+static inline void
+*pheap_pointer(pheap *heap, uint64_t offset) {
+    return offset == 0 ? NULL : (char *) heap + offset;
+}
+
+#endif //CS3650_PHEAP_T_H
@@ -0,0 +1,28 @@
+#ifndef CS3650_PROBES_H
+#define CS3650_PROBES_H
+
+// Static tracepoints on the allocator's slow paths, under the provider name opt_malloc. With
+// <sys/sdt.h> available each one compiles to a single nop plus a note in the binary, so perf and
+// bpftrace can attach to a running process:
+//
+//     bpftrace -e 'usdt:./bench-par:opt_malloc:lock_wait { @[arg0] = hist(arg2); }'
+//
+// Build with -DOPT_MALLOC_NO_PROBES to leave them out altogether.
+#if !defined(OPT_MALLOC_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define OPT_MALLOC_HAS_PROBES 1
+#endif
+#endif
+
+#ifdef OPT_MALLOC_HAS_PROBES
+#define PROBE1(name, a) DTRACE_PROBE1(opt_malloc, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(opt_malloc, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(opt_malloc, name, a, b, c)
+#else
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+#endif //CS3650_PROBES_H
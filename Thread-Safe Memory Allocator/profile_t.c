@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "bin_t.h"
+#include "profile_t.h"
+#include "size_class.h"
+#include "conf_t.h"
+
+// Pages a tuned class's bin may have, so that chunk offsets stay below 2^15 for chunk_index
+#define MAX_CLASS_PAGES 8
+
+#define CLASS_INFO(ci, size, pages) {size, CLASS_MAGIC(size), CLASS_ITEMS(size, pages), pages},
+class_info class_table[NUM_OF_BIN_SIZES] = {SIZE_CLASSES(CLASS_INFO)};
+#define CLASS_SIZE(ci, size, pages) size,
+static const uint32_t default_sizes[NUM_OF_BIN_SIZES] = {SIZE_CLASSES(CLASS_SIZE)};
+bool classes_tuned = false;
+uint8_t class_lookup[MAX_SMALL_SIZE / 4 + 1];
+
+__thread long profile_countdown = 0;
+__thread unsigned long profile_seed = 0;
+
+// Sampled requests by size, for profile_out
+static long histogram[MAX_SMALL_SIZE + 1];
+static long samples = 0;
+static long warmup = 0;
+static char *out_path = NULL;
+// The profile the classes were tuned to, and the waste it predicts for either table
+static char *in_path = NULL;
+static double default_waste = 0;
+static double tuned_waste = 0;
+
+/**
+ * ================================================================
+ * Profiles
+ * ================================================================
+ */
+
+/**
+ * Adds a profile to a histogram. A profile is text, one "size count" pair per line, so profiles of
+ * several runs can simply be concatenated. Lines starting with # are skipped.
+ *
+ * @return the number of requests read, or -1 if the file cannot be read
+ */
+long
+read_profile(const char *path, long *hist) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    long total = 0;
+    char line[128];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        long size;
+        long count;
+        if (line[0] != '#' && sscanf(line, "%ld %ld", &size, &count) == 2 && size >= 0 &&
+            size <= MAX_SMALL_SIZE && count > 0) {
+            hist[size] += count;
+            total += count;
+        }
+    }
+    fclose(fp);
+    return total;
+}
+
+void
+save_profile() {
+    FILE *fp = fopen(out_path, "w");
+    if (fp == NULL) {
+        perror("opt_malloc: profile");
+        return;
+    }
+    fprintf(fp, "# opt_malloc size profile: size count\n");
+    for (int ii = 0; ii <= MAX_SMALL_SIZE; ++ii) {
+        long count = __atomic_load_n(&histogram[ii], __ATOMIC_RELAXED);
+        if (count > 0) {
+            fprintf(fp, "%d %ld\n", ii, count);
+        }
+    }
+    fclose(fp);
+}
+
+void
+save_profile_at_exit() {
+    if (warmup == 0) {
+        save_profile();
+    }
+}
+
+/**
+ * ================================================================
+ * Tuning
+ * ================================================================
+ */
+
+/**
+ * Gives the share of chunk bytes that requests of a histogram would leave unused with the given
+ * chunk sizes.
+ */
+double
+class_waste(long *hist, const uint32_t *sizes) {
+    double used = 0;
+    double chunks = 0;
+    int ci = 0;
+    for (int size = 0; size <= MAX_SMALL_SIZE; ++size) {
+        while (sizes[ci] < (uint32_t) size) {
+            ci += 1;
+        }
+        used += (double) hist[size] * size;
+        chunks += (double) hist[size] * sizes[ci];
+    }
+    return chunks > 0 ? 1 - used / chunks : 0;
+}
+
+/**
+ * Picks the chunk sizes that waste the fewest bytes on a histogram of requests, by dynamic
+ * programming over the candidate sizes: every size requested, rounded up to 8 bytes, and the
+ * default sizes so that sizes the profile missed are not left with only a much larger class.
+ * The largest class stays MAX_SMALL_SIZE.
+ *
+ * @param hist requests by size
+ * @param sizes set to NUM_OF_BIN_SIZES chunk sizes, smallest first
+ */
+void
+derive_classes(long *hist, uint32_t *sizes) {
+    static double count_sum[MAX_SMALL_SIZE + 2];
+    static double bytes_sum[MAX_SMALL_SIZE + 2];
+    static int cand[MAX_SMALL_SIZE + 1];
+    static double cost[NUM_OF_BIN_SIZES][MAX_SMALL_SIZE + 1];
+    static int from[NUM_OF_BIN_SIZES][MAX_SMALL_SIZE + 1];
+
+    bool candidate[MAX_SMALL_SIZE + 1] = {false};
+    for (int size = 0; size <= MAX_SMALL_SIZE; ++size) {
+        count_sum[size + 1] = count_sum[size] + hist[size];
+        bytes_sum[size + 1] = bytes_sum[size] + (double) hist[size] * size;
+        if (hist[size] > 0) {
+            int rounded = size < 8 ? 8 : (size + 7) & ~7;
+            candidate[rounded < MAX_SMALL_SIZE ? rounded : MAX_SMALL_SIZE] = true;
+        }
+    }
+    for (int ii = 0; ii < NUM_OF_BIN_SIZES; ++ii) {
+        candidate[default_sizes[ii]] = true;
+    }
+    int n = 0;
+    for (int size = 0; size <= MAX_SMALL_SIZE; ++size) {
+        if (candidate[size]) {
+            cand[n++] = size;
+        }
+    }
+
+    // cost[k][j]: least waste for every size up to cand[j] with k + 1 classes, the last cand[j]
+    for (int jj = 0; jj < n; ++jj) {
+        cost[0][jj] = cand[jj] * count_sum[cand[jj] + 1] - bytes_sum[cand[jj] + 1];
+        from[0][jj] = -1;
+    }
+    for (int kk = 1; kk < NUM_OF_BIN_SIZES; ++kk) {
+        for (int jj = 0; jj < n; ++jj) {
+            cost[kk][jj] = -1;
+            int hi = cand[jj] + 1;
+            for (int ii = kk - 1; ii < jj; ++ii) {
+                int lo = cand[ii] + 1;
+                double c = cost[kk - 1][ii] + cand[jj] * (count_sum[hi] - count_sum[lo]) -
+                           (bytes_sum[hi] - bytes_sum[lo]);
+                if (cost[kk][jj] < 0 || c < cost[kk][jj]) {
+                    cost[kk][jj] = c;
+                    from[kk][jj] = ii;
+                }
+            }
+        }
+    }
+    for (int kk = NUM_OF_BIN_SIZES - 1, jj = n - 1; kk >= 0; jj = from[kk][jj], --kk) {
+        sizes[kk] = cand[jj];
+    }
+}
+
+/**
+ * Picks the pages of a tuned class's bins: the fewest that leave no more than a sixteenth of the
+ * run unused, or failing that the ones that leave the least. Longer runs than needed would only
+ * keep more pages alive for a few chunks.
+ */
+int
+class_pages(uint32_t size) {
+    int best = 1;
+    for (int pages = 1; pages <= MAX_CLASS_PAGES; ++pages) {
+        size_t bytes = pages * PAGE_SIZE;
+        if ((bytes % size) * 16 <= bytes) {
+            return pages;
+        }
+        if ((bytes % size) * best * PAGE_SIZE < (best * PAGE_SIZE % size) * bytes) {
+            best = pages;
+        }
+    }
+    return best;
+}
+
+void
+apply_classes(const uint32_t *sizes) {
+    for (int ci = 0; ci < NUM_OF_BIN_SIZES; ++ci) {
+        int pages = class_pages(sizes[ci]);
+        class_table[ci] = (class_info) {sizes[ci], CLASS_MAGIC(sizes[ci]),
+                                        CLASS_ITEMS(sizes[ci], pages), pages};
+    }
+    int ci = 0;
+    for (int ii = 0; ii <= MAX_SMALL_SIZE / 4; ++ii) {
+        while (class_table[ci].size < (uint32_t) ii * 4) {
+            ci += 1;
+        }
+        class_lookup[ii] = ci;
+    }
+    classes_tuned = true;
+}
+
+/**
+ * ================================================================
+ * Sampling
+ * ================================================================
+ */
+
+/**
+ * Reads the size profile settings. profile:FILE tunes the size classes to the request sizes in FILE
+ * before the first bin is made. profile_out:FILE samples one in about profile_rate small
+ * allocations (16 by default) and writes their sizes to FILE at exit, or as soon as
+ * profile_warmup sizes have been sampled, for a process that does not exit; the next run started
+ * with that file as its profile uses the tuned classes.
+ */
+void
+init_profile() {
+    char *env = opt_config.profile;
+    if (env[0] != 0) {
+        static long hist[MAX_SMALL_SIZE + 1];
+        if (read_profile(env, hist) > 0) {
+            uint32_t sizes[NUM_OF_BIN_SIZES];
+            derive_classes(hist, sizes);
+            apply_classes(sizes);
+            in_path = env;
+            default_waste = class_waste(hist, default_sizes);
+            tuned_waste = class_waste(hist, sizes);
+        } else {
+            fprintf(stderr, "opt_malloc: no sizes in profile %s, using the default classes\n", env);
+        }
+    }
+    if (opt_config.profile_out[0] != 0) {
+        out_path = opt_config.profile_out;
+        warmup = opt_config.profile_warmup;
+        atexit(save_profile_at_exit);
+    }
+}
+
+/**
+ * Called when a thread's countdown runs out; picks the distance to the next sample at random,
+ * averaging the rate, so that sizes allocated in a fixed rotation are all seen. With sampling off
+ * the countdown is pushed far out, but not out of reach, so that opt_mallctl can turn it back on.
+ *
+ * @return whether the current allocation is sampled
+ */
+bool
+profile_resample() {
+    long rate = out_path != NULL ? CONF(profile_rate) : 0;
+    if (rate == 0) {
+        profile_countdown = 1 << 20;
+        return false;
+    }
+    if (profile_seed == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        profile_seed = (uintptr_t) &profile_seed ^ (unsigned long) ts.tv_nsec ^ 1;
+    }
+    // xorshift64
+    profile_seed ^= profile_seed << 13;
+    profile_seed ^= profile_seed >> 7;
+    profile_seed ^= profile_seed << 17;
+    profile_countdown = 1 + (long) (profile_seed % (2 * (unsigned long) rate - 1));
+    return true;
+}
+
+void
+profile_record(size_t bytes) {
+    __atomic_add_fetch(&histogram[bytes], 1, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&samples, 1, __ATOMIC_RELAXED) == warmup) {
+        save_profile();
+    }
+}
+
+void
+print_profile_stats() {
+    if (classes_tuned) {
+        fprintf(stderr, "Classes:  tuned to %s, %.1f%% of chunk bytes unused, %.1f%% by default\n",
+                in_path, tuned_waste * 100, default_waste * 100);
+        fprintf(stderr, "Sizes:   ");
+        for (int ci = 0; ci < NUM_OF_BIN_SIZES; ++ci) {
+            fprintf(stderr, " %u", class_table[ci].size);
+        }
+        fprintf(stderr, "\n");
+    }
+    if (out_path != NULL) {
+        fprintf(stderr, "Profile:  %ld sizes sampled for %s\n",
+                __atomic_load_n(&samples, __ATOMIC_RELAXED), out_path);
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef CS3650_PROFILE_T_H
+#define CS3650_PROFILE_T_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Small allocations left until this thread samples one's size; stays far off when profiling is off
+extern __thread long profile_countdown;
+
+void init_profile();
+
+bool profile_resample();
+
+void profile_record(size_t bytes);
+
+void print_profile_stats();
+
+/**
+ * Tells whether this small allocation's size should go in the profile. Only counts down a
+ * thread-local counter unless it is the one in profile_rate that is sampled.
+ */
+static inline bool
+profile_sample() {
+    return __builtin_expect(--profile_countdown <= 0, 0) && profile_resample();
+}
+
+#endif //CS3650_PROFILE_T_H
@@ -0,0 +1,82 @@
+#include <stdint.h>
+#include <pthread.h>
+#include "bin_t.h"
+#include "remote_t.h"
+
+static pthread_once_t remote_once = PTHREAD_ONCE_INIT;
+static pthread_key_t remote_key;
+
+__thread remote_buffer remote_buffers[REMOTE_BUFFERS];
+__thread bool remote_registered = false;
+
+/**
+ * Hands a buffer's chunks to their chain as one batch and empties the buffer.
+ */
+void
+flush_remote(remote_buffer *buf) {
+    if (buf->count != 0) {
+        push_remote(buf->head, buf->first, buf->last);
+    }
+    buf->first = NULL;
+    buf->last = NULL;
+    buf->count = 0;
+}
+
+/**
+ * Hands every chunk the calling thread is holding on to back to its chain. Runs when a thread
+ * exits, and from opt_trim.
+ */
+void
+flush_remote_buffers() {
+    for (int ii = 0; ii < REMOTE_BUFFERS; ++ii) {
+        flush_remote(&remote_buffers[ii]);
+    }
+}
+
+/**
+ * Runs when a thread exits. Another destructor may still free after this one, so the thread is
+ * registered again on its next remote free, which makes the key's destructor run once more.
+ */
+void
+leave_remote(void *arg) {
+    (void) arg;
+    flush_remote_buffers();
+    remote_registered = false;
+}
+
+void
+create_remote_key() {
+    pthread_key_create(&remote_key, leave_remote);
+}
+
+/**
+ * Frees a chunk of another arena's chain. Rather than touching that chain's bins, and their cache
+ * lines, on every free, the chunk goes into a buffer of this thread for the chain, and a full
+ * buffer is handed over as one linked batch. Each chain maps to one buffer; a chain that takes
+ * over a buffer flushes the old chain's chunks first.
+ *
+ * @param bin the bin the chunk belongs to, at least pointer-sized
+ * @param item the chunk
+ */
+void
+remote_free(bin_t *bin, void *item) {
+    if (!remote_registered) {
+        pthread_once(&remote_once, create_remote_key);
+        pthread_setspecific(remote_key, remote_buffers);
+        remote_registered = true;
+    }
+    remote_buffer *buf = &remote_buffers[((uintptr_t) bin->head >> 6) % REMOTE_BUFFERS];
+    if (buf->head != bin->head) {
+        flush_remote(buf);
+        buf->head = bin->head;
+    }
+    *(void **) item = buf->first;
+    buf->first = item;
+    if (buf->last == NULL) {
+        buf->last = item;
+    }
+    buf->count += 1;
+    if (buf->count == REMOTE_BATCH) {
+        flush_remote(buf);
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef CS3650_REMOTE_T_H
+#define CS3650_REMOTE_T_H
+
+#include "bin_t.h"
+
+// Chains a thread can be buffering frees for at once, and frees per batch handed over
+#define REMOTE_BUFFERS 8
+#define REMOTE_BATCH 16
+
+// Chunks this thread freed that belong to another arena's chain, linked through their first word
+typedef struct remote_buffer {
+    bin_t *head;
+    void *first;
+    void *last;
+    int count;
+} remote_buffer;
+
+void remote_free(bin_t *bin, void *item);
+
+void flush_remote_buffers();
+
+#endif //CS3650_REMOTE_T_H
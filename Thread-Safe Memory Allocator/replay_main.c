@@ -0,0 +1,185 @@
+// Replays an allocation trace recorded with XMALLOC_TRACE.
+//
+// Every thread of the trace gets a thread of its own that makes the
+// same calls in the same order. Calls on one object by different
+// threads keep their recorded order: a thread waits until every earlier
+// call on the object has been replayed before it makes its own. Other
+// than that threads run freely, so the replay keeps the structure of
+// the original interleaving without forcing its exact timing.
+//
+// Reports calls per second and peak RSS. Link with sys, hw7 or par like
+// the Collatz programs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <assert.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "xmalloc.h"
+#include "xtrace.h"
+
+typedef struct replay_thread {
+    long*     calls; // indices into the trace
+    long      count;
+    pthread_t thread;
+} replay_thread;
+
+xtrace_record* records;
+long           nrecords;
+// For every call, how many calls on the same object came before it
+uint32_t*      turns;
+// The current address of every object, and how many of its calls are
+// done so far
+void**         objects;
+uint32_t*      done;
+
+pthread_barrier_t start;
+
+double
+now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Reads a "Name: N kB" line of /proc/self/status.
+long
+status_kb(const char* name)
+{
+    char line[128];
+    long kb = 0;
+    size_t len = strlen(name);
+    FILE* fp = fopen("/proc/self/status", "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            if (strncmp(line, name, len) == 0 && line[len] == ':') {
+                kb = atol(line + len + 1);
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    return kb;
+}
+
+// The replay's own bookkeeping stays out of the allocator under test.
+void*
+map_zeroed(size_t size)
+{
+    void* mem = mmap(0, size ? size : 1, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(mem != MAP_FAILED);
+    return mem;
+}
+
+void*
+replay(void* arg)
+{
+    replay_thread* rt = arg;
+    pthread_barrier_wait(&start);
+    for (long ii = 0; ii < rt->count; ++ii) {
+        xtrace_record* rec = &records[rt->calls[ii]];
+        uint32_t id = rec->id;
+        while (__atomic_load_n(&done[id], __ATOMIC_ACQUIRE) != turns[rt->calls[ii]]) {
+            sched_yield();
+        }
+        if (rec->op == XTRACE_MALLOC) {
+            objects[id] = xmalloc(rec->size);
+        }
+        else if (rec->op == XTRACE_REALLOC) {
+            objects[id] = xrealloc(objects[id], rec->size);
+        }
+        else {
+            xfree(objects[id]);
+            objects[id] = 0;
+        }
+        // Touch what was handed out, like the program that was traced
+        if (objects[id] && rec->size > 0) {
+            *((char*) objects[id]) = 1;
+        }
+        __atomic_store_n(&done[id], done[id] + 1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        printf("Usage: %s TRACE\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (long) sizeof(xtrace_header)) {
+        printf("Cannot read trace: %s\n", argv[1]);
+        return 1;
+    }
+    char* data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    assert(data != MAP_FAILED);
+    xtrace_header* header = (xtrace_header*) data;
+    if (header->magic != XTRACE_MAGIC || header->record_size != sizeof(xtrace_record)) {
+        printf("Not a trace: %s\n", argv[1]);
+        return 1;
+    }
+    records = (xtrace_record*) (data + sizeof(xtrace_header));
+    nrecords = (st.st_size - sizeof(xtrace_header)) / sizeof(xtrace_record);
+
+    // Number the calls on each object, and split the calls by thread.
+    long nthreads = 0;
+    long nobjects = 0;
+    for (long ii = 0; ii < nrecords; ++ii) {
+        if (records[ii].thread >= nthreads) {
+            nthreads = records[ii].thread + 1;
+        }
+        if (records[ii].id >= nobjects) {
+            nobjects = records[ii].id + 1;
+        }
+    }
+    turns = map_zeroed(nrecords * sizeof(uint32_t));
+    objects = map_zeroed(nobjects * sizeof(void*));
+    done = map_zeroed(nobjects * sizeof(uint32_t));
+    replay_thread* threads = map_zeroed(nthreads * sizeof(replay_thread));
+    for (long ii = 0; ii < nrecords; ++ii) {
+        turns[ii] = done[records[ii].id]++;
+        threads[records[ii].thread].count += 1;
+    }
+    memset(done, 0, nobjects * sizeof(uint32_t));
+    for (long tt = 0; tt < nthreads; ++tt) {
+        threads[tt].calls = map_zeroed(threads[tt].count * sizeof(long));
+        threads[tt].count = 0;
+    }
+    for (long ii = 0; ii < nrecords; ++ii) {
+        replay_thread* rt = &threads[records[ii].thread];
+        rt->calls[rt->count++] = ii;
+    }
+
+    // The trace and the tables count towards RSS too; report them apart
+    long base_kb = status_kb("VmRSS");
+    pthread_barrier_init(&start, 0, nthreads + 1);
+    for (long tt = 0; tt < nthreads; ++tt) {
+        int rv = pthread_create(&threads[tt].thread, 0, replay, &threads[tt]);
+        assert(rv == 0);
+    }
+    double t0 = now();
+    pthread_barrier_wait(&start);
+    for (long tt = 0; tt < nthreads; ++tt) {
+        int rv = pthread_join(threads[tt].thread, 0);
+        assert(rv == 0);
+    }
+    double t1 = now();
+
+    printf("replay: %ld calls by %ld threads on %ld objects in %.3fs (%.2f Mops/s), "
+           "peak RSS %ld kB over %ld kB before the replay\n", nrecords, nthreads, nobjects,
+           t1 - t0, nrecords / (t1 - t0) / 1e6, status_kb("VmHWM") - base_kb, base_kb);
+    return 0;
+}
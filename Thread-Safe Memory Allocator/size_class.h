@@ -0,0 +1,69 @@
+#ifndef CS3650_SIZE_CLASS_H
+#define CS3650_SIZE_CLASS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The default size classes as X(index, chunk size, pages per bin). Pages per bin is the shortest
+// run that the chunks fill exactly, with room for eight. Everything else about a class is derived
+// from this list at compile time.
+#define SIZE_CLASSES(X) \
+    X(0, 4, 1) X(1, 8, 1) X(2, 12, 3) X(3, 16, 1) X(4, 24, 3) X(5, 32, 1) X(6, 48, 3) \
+    X(7, 64, 1) X(8, 96, 3) X(9, 128, 1) X(10, 192, 3) X(11, 256, 1) X(12, 384, 3) \
+    X(13, 512, 1) X(14, 768, 3) X(15, 1024, 2) X(16, 1536, 3) X(17, 2048, 4) X(18, 3072, 6)
+
+#define NUM_OF_BIN_SIZES 19
+#define MAX_SMALL_SIZE 3072
+
+// Chunks per bin, at most one per bit of the bitmap
+#define CLASS_ITEMS(size, pages) ((pages) * 4096 / (size) < 1024 ? (pages) * 4096 / (size) : 1024)
+// ceil(2^32 / size). Offsets into a bin are under 2^15, for which (offset * magic) >> 32 equals
+// offset / size exactly, since the rounding error stays below 1 / size.
+#define CLASS_MAGIC(size) ((uint32_t) (UINT32_MAX / (size) + 1))
+
+typedef struct class_info {
+    uint32_t size;
+    uint32_t magic;
+    int max_items;
+    int pages;
+} class_info;
+
+// The classes in use: the defaults, or a table tuned to a size profile when the allocator starts.
+// Tuned chunk sizes are multiples of 4 and the largest is still MAX_SMALL_SIZE.
+extern class_info class_table[NUM_OF_BIN_SIZES];
+extern bool classes_tuned;
+// With tuned classes, the class of every size, by the size rounded up to 4 bytes
+extern uint8_t class_lookup[MAX_SMALL_SIZE / 4 + 1];
+
+/**
+ * Divides an offset into a bin by the chunk size with a multiply and a shift.
+ */
+static inline int
+chunk_index(size_t offset, uint32_t magic) {
+    return (int) (((uint64_t) offset * magic) >> 32);
+}
+
+/**
+ * Returns the smallest class that holds the given number of bytes, without a search. Of the
+ * default classes, up to 16 bytes are 4 apart; above that each power of two 2^k is followed by
+ * 1.5 * 2^k. Tuned classes are looked up.
+ *
+ * @return the class, or -1 if the bytes need a large bin
+ */
+static inline int
+size_class_of(size_t bytes) {
+    if (bytes > MAX_SMALL_SIZE) {
+        return -1;
+    }
+    if (classes_tuned) {
+        return class_lookup[(bytes + 3) >> 2];
+    }
+    if (bytes <= 16) {
+        return bytes == 0 ? 0 : (int) (bytes - 1) >> 2;
+    }
+    int k = 63 - __builtin_clzl(bytes - 1);
+    return 2 * (k - 4) + 4 + (bytes > (size_t) 3 << (k - 1));
+}
+
+#endif //CS3650_SIZE_CLASS_H
@@ -0,0 +1,612 @@
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include "bin_t.h"
+#include "span_t.h"
+#include "conf_t.h"
+#include "lockstat_t.h"
+#include "probes.h"
+
+#define META_CHUNK_SIZE (16 * PAGE_SIZE)
+
+static pthread_once_t spans_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t span_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool huge_spans = false;
+// The span that pages are currently being carved from
+static void *cur_span = NULL;
+static size_t cur_offset = 0;
+static size_t cur_size = 0;
+// The chunk that allocator metadata is currently being carved from
+static void *meta_chunk = NULL;
+static size_t meta_offset = META_CHUNK_SIZE;
+static pthread_mutex_t meta_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Empty runs of pages that still hold physical memory, oldest first, by run length
+static extent_list dirty[MAX_RUN_PAGES];
+// Empty runs that were purged with MADV_FREE and can be reused without an mmap
+static extent_list muzzy[MAX_RUN_PAGES];
+static long dirty_pages = 0;
+static long muzzy_pages = 0;
+// Empty large mappings, oldest first
+static extent_list large;
+// Pages currently held by bins, and the highest that has been in the recent past
+static long pages_active = 0;
+static long pages_high = 0;
+static long next_purge_ms = 0;
+static span_stats stats;
+
+/**
+ * ================================================================
+ * Span setup
+ * ================================================================
+ */
+
+void
+read_span_config() {
+    load_conf();
+    huge_spans = opt_config.thp;
+}
+
+/**
+ * Reads the span configuration. Huge spans are opt-in through thp:true since they trade a 2 MiB
+ * reservation per span for fewer dTLB misses. Without them, pages are carved from unaligned spans
+ * of span_pages pages. decay_ms sets how long an empty page keeps its memory before it is purged.
+ */
+void
+init_spans() {
+    pthread_once(&spans_once, read_span_config);
+}
+
+bool
+spans_enabled() {
+    return huge_spans;
+}
+
+/**
+ * Reserves a SPAN_SIZE-aligned span of private memory and asks the kernel to back it with a
+ * transparent huge page. Over-maps by one span and trims both ends to get the alignment.
+ *
+ * @return the aligned span
+ */
+void
+*map_huge_span() {
+    void *raw = mmap(0, 2 * SPAN_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    check_rv((long) raw);
+    uintptr_t base = ((uintptr_t) raw + SPAN_SIZE - 1) & ~((uintptr_t) SPAN_SIZE - 1);
+    size_t head = base - (uintptr_t) raw;
+    if (head != 0) {
+        munmap(raw, head);
+    }
+    munmap((void *) (base + SPAN_SIZE), SPAN_SIZE - head);
+    madvise((void *) base, SPAN_SIZE, MADV_HUGEPAGE);
+    return (void *) base;
+}
+
+/**
+ * Starts a new span to carve pages from: a huge-page span if those are on, a small one otherwise.
+ * Must hold span_mutex.
+ */
+void
+next_span() {
+    cur_size = huge_spans ? SPAN_SIZE : CONF(span_pages) * PAGE_SIZE;
+    cur_span = huge_spans ? map_huge_span() : map_memory(cur_size);
+    cur_offset = 0;
+    PROBE2(span_map, cur_span, cur_size);
+    stats.spans_mapped += 1;
+    stats.span_bytes += cur_size;
+}
+
+/**
+ * Returns zeroed memory for allocator bookkeeping that lives for the rest of the process. Requests
+ * are carved out of shared chunks in cache-line multiples, so most calls make no syscall.
+ *
+ * @param size bytes needed, at most META_CHUNK_SIZE
+ * @return the memory
+ */
+void
+*meta_alloc(size_t size) {
+    size = (size + 63) & ~(size_t) 63;
+    pthread_mutex_lock(&meta_mutex);
+    if (meta_offset + size > META_CHUNK_SIZE) {
+        meta_chunk = map_memory(META_CHUNK_SIZE);
+        meta_offset = 0;
+    }
+    void *mem = meta_chunk + meta_offset;
+    meta_offset += size;
+    pthread_mutex_unlock(&meta_mutex);
+    return mem;
+}
+
+/**
+ * ================================================================
+ * Extent lists
+ * ================================================================
+ */
+
+/**
+ * Appends an extent as the newest entry of the list. The backing array lives in its own mapping so
+ * that the list can grow without calling back into the allocator.
+ */
+void
+extent_push(extent_list *list, void *addr, size_t size, long freed_ms) {
+    if (list->end == list->cap) {
+        if (list->start > list->cap / 2) {
+            memmove(list->items, list->items + list->start,
+                    (list->end - list->start) * sizeof(extent));
+            list->end -= list->start;
+            list->start = 0;
+        } else {
+            size_t cap = list->cap == 0 ? PAGE_SIZE / sizeof(extent) : list->cap * 2;
+            extent *items = map_memory(cap * sizeof(extent));
+            if (list->items != NULL) {
+                memcpy(items, list->items, list->cap * sizeof(extent));
+                munmap(list->items, list->cap * sizeof(extent));
+            }
+            list->items = items;
+            list->cap = cap;
+        }
+    }
+    extent *e = &list->items[list->end++];
+    e->addr = addr;
+    e->size = size;
+    e->freed_ms = freed_ms;
+}
+
+size_t
+extent_count(extent_list *list) {
+    return list->end - list->start;
+}
+
+extent
+*extent_oldest(extent_list *list) {
+    return extent_count(list) == 0 ? NULL : &list->items[list->start];
+}
+
+void
+*extent_pop_oldest(extent_list *list) {
+    return list->items[list->start++].addr;
+}
+
+void
+*extent_pop_newest(extent_list *list) {
+    return list->items[--list->end].addr;
+}
+
+/**
+ * Removes the smallest extent that can hold the given size without wasting more than a quarter of
+ * it.
+ *
+ * @param size page-rounded size needed
+ * @return the extent, or an extent with a NULL address if none fit
+ */
+extent
+extent_take_fit(extent_list *list, size_t size) {
+    extent best = {NULL, 0, 0};
+    size_t best_ii = 0;
+    for (size_t ii = list->start; ii < list->end; ++ii) {
+        size_t s = list->items[ii].size;
+        if (s >= size && s <= size + size / 4 && (best.addr == NULL || s < best.size)) {
+            best = list->items[ii];
+            best_ii = ii;
+        }
+    }
+    if (best.addr != NULL) {
+        memmove(&list->items[best_ii], &list->items[best_ii + 1],
+                (list->end - best_ii - 1) * sizeof(extent));
+        list->end -= 1;
+    }
+    return best;
+}
+
+/**
+ * ================================================================
+ * Purging
+ * ================================================================
+ */
+
+long
+now_ms() {
+    struct timespec ts;
+    // The coarse clock is served from the vDSO, so this is not a syscall
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Unmaps a range the allocator has no more use for.
+ */
+void
+unmap_range(void *addr, size_t size) {
+    PROBE2(unmap, addr, size);
+    munmap(addr, size);
+}
+
+/**
+ * Tells the kernel it may take back the memory of a range that we keep mapped. MADV_FREE is lazy
+ * and cheap to undo; kernels without it get MADV_DONTNEED.
+ */
+void
+purge_range(void *addr, size_t size) {
+    if (madvise(addr, size, MADV_FREE) == -1 && errno == EINVAL) {
+        madvise(addr, size, MADV_DONTNEED);
+    }
+    stats.pages_purged += size / PAGE_SIZE;
+}
+
+void
+push_muzzy(void *addr, size_t pages, long now) {
+    extent_push(&muzzy[pages - 1], addr, pages * PAGE_SIZE, now);
+    muzzy_pages += pages;
+}
+
+/**
+ * Gives a run of pages that is no longer wanted back to the OS. Pages inside a huge span can't be
+ * unmapped without splitting the span, so they are dropped with MADV_DONTNEED and stay reusable.
+ */
+void
+release_run(void *addr, size_t pages) {
+    if (huge_spans) {
+        madvise(addr, pages * PAGE_SIZE, MADV_DONTNEED);
+        push_muzzy(addr, pages, 0);
+    } else {
+        unmap_range(addr, pages * PAGE_SIZE);
+        stats.pages_unmapped += pages;
+    }
+}
+
+/**
+ * Unmaps the oldest purged run, if there is one and pages are not part of huge spans.
+ *
+ * @return whether a run was unmapped
+ */
+bool
+unmap_oldest_muzzy() {
+    if (huge_spans) {
+        return false;
+    }
+    for (size_t pages = 1; pages <= MAX_RUN_PAGES; ++pages) {
+        if (extent_count(&muzzy[pages - 1]) != 0) {
+            unmap_range(extent_pop_oldest(&muzzy[pages - 1]), pages * PAGE_SIZE);
+            muzzy_pages -= pages;
+            stats.pages_unmapped += pages;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Purges every empty run and large extent whose decay time has run out, and lets the working set
+ * high-water mark decay towards the current working set. Runs four times per decay period. Must
+ * hold span_mutex.
+ */
+void
+purge_expired(long now) {
+    long decay_ms = CONF(decay_ms);
+    extent *e;
+    for (size_t pages = 1; pages <= MAX_RUN_PAGES; ++pages) {
+        extent_list *list = &dirty[pages - 1];
+        while ((e = extent_oldest(list)) != NULL && e->freed_ms + decay_ms <= now) {
+            void *addr = extent_pop_oldest(list);
+            dirty_pages -= pages;
+            purge_range(addr, pages * PAGE_SIZE);
+            push_muzzy(addr, pages, now);
+        }
+    }
+    while ((e = extent_oldest(&large)) != NULL && e->freed_ms + decay_ms <= now) {
+        unmap_range(e->addr, e->size);
+        stats.pages_unmapped += e->size / PAGE_SIZE;
+        extent_pop_oldest(&large);
+    }
+    // Close a quarter of the gap between the high-water mark and the working set every tick, and
+    // unmap purged pages that the lower mark no longer justifies keeping
+    pages_high -= (pages_high - pages_active) / 4;
+    while (dirty_pages + muzzy_pages > pages_high - pages_active && unmap_oldest_muzzy()) {
+    }
+    next_purge_ms = now + decay_ms / 4 + 1;
+}
+
+/**
+ * Runs the purge if its time has come. Cheap enough to call on every page-level operation.
+ */
+void
+maybe_purge() {
+    long now = now_ms();
+    if (now >= next_purge_ms) {
+        purge_expired(now);
+    }
+}
+
+void
+span_purge() {
+    timed_lock(&span_mutex, LOCK_SPAN);
+    purge_expired(now_ms());
+    pthread_mutex_unlock(&span_mutex);
+}
+
+/**
+ * Counts how many pages of a purged range the kernel has not taken back yet.
+ */
+long
+resident_pages(void *addr, size_t size) {
+    unsigned char vec[1];
+    long count = 0;
+    for (size_t off = 0; off < size; off += PAGE_SIZE) {
+        if (mincore(addr + off, PAGE_SIZE, vec) == 0 && (vec[0] & 1)) {
+            count += 1;
+        }
+    }
+    return count;
+}
+
+/**
+ * Gives back everything the page cache holds beyond pad bytes of warm pages: all cached large
+ * extents, the older dirty runs, and purged pages the kernel has not reclaimed yet. Also forgets
+ * the working set high-water mark, since a trim means memory is needed elsewhere.
+ *
+ * @param pad bytes of dirty pages to keep for upcoming allocations
+ * @return the number of bytes given back
+ */
+size_t
+span_trim(size_t pad) {
+    size_t released = 0;
+    long keep = (long) (pad / PAGE_SIZE);
+    timed_lock(&span_mutex, LOCK_SPAN);
+    while (extent_count(&large) != 0) {
+        extent *e = extent_oldest(&large);
+        unmap_range(e->addr, e->size);
+        stats.pages_unmapped += e->size / PAGE_SIZE;
+        released += e->size;
+        extent_pop_oldest(&large);
+    }
+    for (size_t pages = 1; pages <= MAX_RUN_PAGES; ++pages) {
+        extent_list *list = &muzzy[pages - 1];
+        for (size_t ii = list->start; ii < list->end; ++ii) {
+            released += resident_pages(list->items[ii].addr, list->items[ii].size) * PAGE_SIZE;
+            if (huge_spans) {
+                madvise(list->items[ii].addr, list->items[ii].size, MADV_DONTNEED);
+            }
+        }
+    }
+    while (unmap_oldest_muzzy()) {
+    }
+    for (size_t pages = MAX_RUN_PAGES; pages >= 1 && dirty_pages > keep; --pages) {
+        extent_list *list = &dirty[pages - 1];
+        while (extent_count(list) != 0 && dirty_pages > keep) {
+            release_run(extent_pop_oldest(list), pages);
+            dirty_pages -= pages;
+            released += pages * PAGE_SIZE;
+        }
+    }
+    pages_high = pages_active;
+    pthread_mutex_unlock(&span_mutex);
+    return released;
+}
+
+/**
+ * ================================================================
+ * Page allocation
+ * ================================================================
+ */
+
+/**
+ * Carves a run of fresh pages out of the current span, starting a new span when this one is too
+ * short. The leftover end of the old span is kept as single purged pages. Must hold span_mutex.
+ */
+void
+*carve_run(size_t pages) {
+    size_t size = pages * PAGE_SIZE;
+    if (cur_offset + size > cur_size) {
+        for (; cur_offset < cur_size; cur_offset += PAGE_SIZE) {
+            push_muzzy(cur_span + cur_offset, 1, 0);
+        }
+        next_span();
+    }
+    void *addr = cur_span + cur_offset;
+    cur_offset += size;
+    stats.pages_carved += pages;
+    return addr;
+}
+
+/**
+ * Returns a run of pages for a bin. Recently emptied runs are preferred since they are still warm,
+ * then purged runs, then fresh memory carved from the current span, so that most calls make no
+ * syscall. With huge spans on, up to 512 pages of bins share one TLB entry.
+ *
+ * @param pages length of the run, at most MAX_RUN_PAGES
+ * @return a page-aligned run of zeroed or recycled memory
+ */
+void
+*span_alloc_pages(size_t pages) {
+    void *addr;
+    timed_lock(&span_mutex, LOCK_SPAN);
+    maybe_purge();
+    pages_active += pages;
+    if (pages_active > pages_high) {
+        pages_high = pages_active;
+    }
+    if (extent_count(&dirty[pages - 1]) != 0) {
+        addr = extent_pop_newest(&dirty[pages - 1]);
+        dirty_pages -= pages;
+        stats.pages_reused += pages;
+    } else if (extent_count(&muzzy[pages - 1]) != 0) {
+        addr = extent_pop_newest(&muzzy[pages - 1]);
+        muzzy_pages -= pages;
+        stats.pages_reused += pages;
+    } else {
+        addr = carve_run(pages);
+    }
+    pthread_mutex_unlock(&span_mutex);
+    return addr;
+}
+
+/**
+ * Gives back a run that was returned by span_alloc_pages. The run keeps its memory until it
+ * decays, as long as the pages we retain would not take us past the recent working set high-water
+ * mark. Anything beyond that is released right away.
+ *
+ * @param addr the run to give back
+ * @param pages length of the run
+ */
+void
+span_free_pages(void *addr, size_t pages) {
+    timed_lock(&span_mutex, LOCK_SPAN);
+    long now = now_ms();
+    pages_active -= pages;
+    if (dirty_pages + muzzy_pages + (long) pages > pages_high - pages_active) {
+        release_run(addr, pages);
+    } else {
+        extent_push(&dirty[pages - 1], addr, pages * PAGE_SIZE, now);
+        dirty_pages += pages;
+    }
+    if (now >= next_purge_ms) {
+        purge_expired(now);
+    }
+    pthread_mutex_unlock(&span_mutex);
+}
+
+size_t
+round_to_pages(size_t size) {
+    return (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+}
+
+/**
+ * Returns a mapping of at least the given size for a large bin, reusing a recently freed one of a
+ * similar size when possible.
+ *
+ * @param size bytes needed; updated to the size of the returned mapping
+ * @return the mapping
+ */
+void
+*span_alloc_extent(size_t *size) {
+    size_t need = round_to_pages(*size);
+    timed_lock(&span_mutex, LOCK_SPAN);
+    maybe_purge();
+    extent e = extent_take_fit(&large, need);
+    if (e.addr != NULL) {
+        stats.extents_reused += 1;
+    }
+    pthread_mutex_unlock(&span_mutex);
+    if (e.addr != NULL) {
+        *size = e.size;
+        __atomic_add_fetch(&stats.large_bytes, e.size, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.large_objects, 1, __ATOMIC_RELAXED);
+        return e.addr;
+    }
+    *size = need;
+    __atomic_add_fetch(&stats.large_bytes, need, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.large_objects, 1, __ATOMIC_RELAXED);
+    void *addr = map_memory(need);
+    PROBE2(extent_map, addr, need);
+    if (huge_spans && need >= SPAN_SIZE) {
+        madvise(addr, need, MADV_HUGEPAGE);
+    }
+    return addr;
+}
+
+/**
+ * Gives back a mapping that was returned by span_alloc_extent. It is kept for reuse until it
+ * decays, unless it is bigger than large_max. The oldest cached extents are unmapped to keep no
+ * more than large_cached of them.
+ */
+void
+span_free_extent(void *addr, size_t size) {
+    size = round_to_pages(size);
+    __atomic_sub_fetch(&stats.large_bytes, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stats.large_objects, 1, __ATOMIC_RELAXED);
+    long cached = CONF(large_cached);
+    if (CONF(decay_ms) == 0 || cached == 0 || (long) size > CONF(large_max)) {
+        unmap_range(addr, size);
+        // Counted under the lock like every other unmap; the munmap itself costs far more
+        timed_lock(&span_mutex, LOCK_SPAN);
+        stats.pages_unmapped += size / PAGE_SIZE;
+        pthread_mutex_unlock(&span_mutex);
+        return;
+    }
+    timed_lock(&span_mutex, LOCK_SPAN);
+    while ((long) extent_count(&large) >= cached) {
+        extent *e = extent_oldest(&large);
+        unmap_range(e->addr, e->size);
+        stats.pages_unmapped += e->size / PAGE_SIZE;
+        extent_pop_oldest(&large);
+    }
+    extent_push(&large, addr, size, now_ms());
+    maybe_purge();
+    pthread_mutex_unlock(&span_mutex);
+}
+
+/**
+ * ================================================================
+ * Stats
+ * ================================================================
+ */
+
+/**
+ * Reads the AnonHugePages total of this process, in bytes. Uses a stack buffer so that it can be
+ * called from inside the allocator.
+ *
+ * @return bytes of anonymous memory backed by huge pages, or 0 if unknown
+ */
+long
+read_thp_bytes() {
+    char buf[4096];
+    int fd = open("/proc/self/smaps_rollup", O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) {
+        return 0;
+    }
+    buf[len] = 0;
+    char *line = strstr(buf, "AnonHugePages:");
+    if (line == NULL) {
+        return 0;
+    }
+    return atol(line + strlen("AnonHugePages:")) * 1024;
+}
+
+/**
+ * Copies the stats without the huge page total, which takes a read of /proc. Cheap enough to call
+ * many times a second. The counters are read under span_mutex, or atomically for the large ones
+ * that are kept without it, and the shared stats are never written, so any number of threads can
+ * take a copy at once.
+ *
+ * @param out where to copy them
+ */
+void
+span_getcounters(span_stats *out) {
+    timed_lock(&span_mutex, LOCK_SPAN);
+    out->spans_mapped = stats.spans_mapped;
+    out->span_bytes = stats.span_bytes;
+    out->pages_carved = stats.pages_carved;
+    out->pages_reused = stats.pages_reused;
+    out->pages_active = pages_active;
+    out->pages_dirty = dirty_pages;
+    out->pages_muzzy = muzzy_pages;
+    out->pages_purged = stats.pages_purged;
+    out->pages_unmapped = stats.pages_unmapped;
+    out->extents_cached = (long) extent_count(&large);
+    out->extents_reused = stats.extents_reused;
+    pthread_mutex_unlock(&span_mutex);
+    out->large_bytes = __atomic_load_n(&stats.large_bytes, __ATOMIC_RELAXED);
+    out->large_objects = __atomic_load_n(&stats.large_objects, __ATOMIC_RELAXED);
+    out->thp_bytes = 0;
+}
+
+/**
+ * Copies the stats, with the huge page total.
+ *
+ * @param out where to copy them
+ */
+void
+span_getstats(span_stats *out) {
+    span_getcounters(out);
+    out->thp_bytes = read_thp_bytes();
+}
@@ -0,0 +1,65 @@
+#ifndef CS3650_SPAN_T_H
+#define CS3650_SPAN_T_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Size and alignment of a transparent huge page on x86-64
+#define SPAN_SIZE (2 * 1024 * 1024)
+// Longest run of pages a bin can be made of
+#define MAX_RUN_PAGES 8
+
+typedef struct extent {
+    void *addr;
+    size_t size;
+    long freed_ms;
+} extent;
+
+// Array of extents ordered from oldest to newest
+typedef struct extent_list {
+    extent *items;
+    size_t start;
+    size_t end;
+    size_t cap;
+} extent_list;
+
+typedef struct span_stats {
+    long spans_mapped;
+    long span_bytes;
+    long pages_carved;
+    long pages_reused;
+    long pages_active;
+    long pages_dirty;
+    long pages_muzzy;
+    long pages_purged;
+    long pages_unmapped;
+    long extents_cached;
+    long extents_reused;
+    long large_bytes;
+    long large_objects;
+    long thp_bytes;
+} span_stats;
+
+void init_spans();
+
+bool spans_enabled();
+
+void *meta_alloc(size_t size);
+
+void *span_alloc_pages(size_t pages);
+
+void span_free_pages(void *addr, size_t pages);
+
+void *span_alloc_extent(size_t *size);
+
+void span_free_extent(void *addr, size_t size);
+
+void span_purge();
+
+size_t span_trim(size_t pad);
+
+void span_getstats(span_stats *out);
+
+void span_getcounters(span_stats *out);
+
+#endif //CS3650_SPAN_T_H
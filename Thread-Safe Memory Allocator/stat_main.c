@@ -0,0 +1,124 @@
+// Samples the stats a running program publishes with
+// OPT_MALLOC_STATS_FILE.
+//
+// The program keeps writing snapshots into the file; this only maps it
+// and reads, so it can sample as often as it likes without the program
+// noticing. With just a file it prints the latest snapshot in full;
+// with an interval it prints one line per sample.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "export_t.h"
+
+long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Copies a consistent snapshot, retrying while the program is in the
+// middle of writing one. Returns the number of retries.
+long
+read_snapshot(export_page* page, export_stats* out)
+{
+    long retries = 0;
+    for (;;) {
+        unsigned long seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+        if (seq % 2 == 0) {
+            const long* src = (const long*) &page->stats;
+            long* dst = (long*) out;
+            for (size_t ii = 0; ii < sizeof(export_stats) / sizeof(long); ++ii) {
+                dst[ii] = __atomic_load_n(&src[ii], __ATOMIC_RELAXED);
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+                return retries;
+            }
+        }
+        retries += 1;
+        sched_yield();
+    }
+}
+
+void
+print_full(export_page* page, export_stats* es)
+{
+    printf("pid %ld, snapshot %ld, %.1f ms old (published every %ld ms)\n",
+           page->pid, es->samples, (now_ns() - es->published_ns) / 1e6, page->period_ms);
+    printf("spans      %ld (%ld kB)\n", es->spans_mapped, es->span_bytes / 1024);
+    printf("pages      %ld active, %ld dirty, %ld muzzy\n",
+           es->pages_active, es->pages_dirty, es->pages_muzzy);
+    printf("released   %ld purged, %ld unmapped\n", es->pages_purged, es->pages_unmapped);
+    printf("large      %ld kB, %ld extents cached\n", es->large_bytes / 1024, es->extents_cached);
+    printf("arenas     %ld, %ld idle\n", es->arenas, es->idle_arenas);
+    printf("caches     %ld chunks (%ld kB)\n", es->cached_chunks, es->cached_bytes / 1024);
+    printf("locks      %ld waits (%ld us), %ld trylock fails\n",
+           es->lock_waits, es->lock_wait_ns / 1000, es->trylock_failed);
+    printf("Class    Live kB  Mapped kB\n");
+    for (int ii = 0; ii < es->nclasses && ii < EXPORT_CLASSES; ++ii) {
+        export_class* ec = &es->classes[ii];
+        if (ec->mapped_bytes > 0) {
+            printf("%5ld %10ld %10ld\n", ec->size, ec->live_bytes / 1024, ec->mapped_bytes / 1024);
+        }
+    }
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc < 2 || argc > 4) {
+        printf("Usage: %s FILE [INTERVAL_MS [COUNT]]\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+        printf("Cannot open: %s\n", argv[1]);
+        return 1;
+    }
+    export_page* page = mmap(0, sizeof(export_page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED || page->magic != EXPORT_MAGIC || page->version != EXPORT_VERSION) {
+        printf("Not an opt_malloc stats file: %s\n", argv[1]);
+        return 1;
+    }
+
+    export_stats es;
+    if (argc == 2) {
+        read_snapshot(page, &es);
+        print_full(page, &es);
+        return 0;
+    }
+
+    long interval_ms = atol(argv[2]);
+    long count = argc == 4 ? atol(argv[3]) : -1;
+    struct timespec interval = {interval_ms / 1000, (interval_ms % 1000) * 1000000};
+    printf("%8s %8s %10s %10s %8s %8s %8s %6s %8s %8s\n", "ms", "snap", "live kB", "mapped kB",
+           "active", "dirty", "muzzy", "arenas", "waits", "retries");
+    long start = now_ns();
+    for (long ii = 0; count < 0 || ii < count; ++ii) {
+        long retries = read_snapshot(page, &es);
+        long live = es.large_bytes;
+        long mapped = es.large_bytes;
+        for (int cc = 0; cc < es.nclasses && cc < EXPORT_CLASSES; ++cc) {
+            live += es.classes[cc].live_bytes;
+            mapped += es.classes[cc].mapped_bytes;
+        }
+        printf("%8.1f %8ld %10ld %10ld %8ld %8ld %8ld %6ld %8ld %8ld\n",
+               (now_ns() - start) / 1e6, es.samples, live / 1024, mapped / 1024,
+               es.pages_active, es.pages_dirty, es.pages_muzzy, es.arenas, es.lock_waits,
+               retries);
+        fflush(stdout);
+        nanosleep(&interval, 0);
+    }
+    return 0;
+}
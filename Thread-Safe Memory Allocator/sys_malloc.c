@@ -1,26 +1,13 @@
-
-
 #include <stdlib.h>
 #include <unistd.h>
 
 #include "xmalloc.h"
 
+static xmalloc_backend sys_backend = {"sys", 0, malloc, free, realloc};
 
-void*
-xmalloc(size_t bytes)
-{
-    return malloc(bytes);
-}
-
-void
-xfree(void* ptr)
+__attribute__((constructor))
+static void
+register_sys()
 {
-    free(ptr);
+    xmalloc_register(&sys_backend);
 }
-
-void*
-xrealloc(void* prev, size_t bytes)
-{
-    return realloc(prev, bytes);
-}
-
@@ -0,0 +1,190 @@
+// Backend selection for the xmalloc interface.
+//
+// The backend is picked on the first call: the one named by
+// XMALLOC_BACKEND, or else the registered one with the highest
+// priority. From then on xmalloc, xfree and xrealloc are one indirect
+// call through a resolved function pointer, with no checks on the way.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "xmalloc.h"
+#include "xtrace.h"
+
+#define MAX_BACKENDS 8
+
+static xmalloc_backend* backends[MAX_BACKENDS];
+static int              nbackends = 0;
+static xmalloc_backend* active = 0;
+static pthread_once_t   resolve_once = PTHREAD_ONCE_INIT;
+
+static void* resolve_malloc(size_t bytes);
+static void  resolve_free(void* ptr);
+static void* resolve_realloc(void* prev, size_t bytes);
+
+// Until the backend is picked these point at stubs that pick it.
+static void* (*malloc_fn)(size_t) = resolve_malloc;
+static void  (*free_fn)(void*) = resolve_free;
+static void* (*realloc_fn)(void*, size_t) = resolve_realloc;
+
+void
+xmalloc_register(xmalloc_backend* backend)
+{
+    if (nbackends < MAX_BACKENDS) {
+        backends[nbackends++] = backend;
+    }
+}
+
+int
+xmalloc_backend_count()
+{
+    return nbackends;
+}
+
+xmalloc_backend*
+xmalloc_backend_at(int ii)
+{
+    return ii < nbackends ? backends[ii] : 0;
+}
+
+static xmalloc_backend*
+find_backend(const char* name)
+{
+    for (int ii = 0; ii < nbackends; ++ii) {
+        if (strcmp(backends[ii]->name, name) == 0) {
+            return backends[ii];
+        }
+    }
+    return 0;
+}
+
+// The traced versions are only installed when XMALLOC_TRACE is set, so
+// an untraced run never pays for the recorder.
+static void*
+traced_malloc(size_t bytes)
+{
+    void* alloc = active->malloc(bytes);
+    xtrace_malloc(alloc, bytes);
+    return alloc;
+}
+
+static void
+traced_free(void* ptr)
+{
+    xtrace_free(ptr);
+    active->free(ptr);
+}
+
+static void*
+traced_realloc(void* prev, size_t bytes)
+{
+    uint32_t id = xtrace_realloc_begin(prev);
+    void* alloc = active->realloc(prev, bytes);
+    xtrace_realloc_end(id, alloc, bytes);
+    return alloc;
+}
+
+static void
+install(xmalloc_backend* backend)
+{
+    active = backend;
+    if (xtrace_enabled()) {
+        __atomic_store_n(&malloc_fn, traced_malloc, __ATOMIC_RELEASE);
+        __atomic_store_n(&free_fn, traced_free, __ATOMIC_RELEASE);
+        __atomic_store_n(&realloc_fn, traced_realloc, __ATOMIC_RELEASE);
+    }
+    else {
+        __atomic_store_n(&malloc_fn, backend->malloc, __ATOMIC_RELEASE);
+        __atomic_store_n(&free_fn, backend->free, __ATOMIC_RELEASE);
+        __atomic_store_n(&realloc_fn, backend->realloc, __ATOMIC_RELEASE);
+    }
+}
+
+static void
+resolve()
+{
+    xmalloc_backend* backend = 0;
+    char* name = getenv("XMALLOC_BACKEND");
+    if (name != 0 && name[0] != 0) {
+        backend = find_backend(name);
+        if (backend == 0) {
+            fprintf(stderr, "xmalloc: no backend named %s\n", name);
+            abort();
+        }
+    }
+    else {
+        for (int ii = 0; ii < nbackends; ++ii) {
+            if (backend == 0 || backends[ii]->priority > backend->priority) {
+                backend = backends[ii];
+            }
+        }
+    }
+    if (backend == 0) {
+        fprintf(stderr, "xmalloc: no backend linked in\n");
+        abort();
+    }
+    install(backend);
+}
+
+// Switches to the named backend. Objects must still be freed by the
+// backend that allocated them, so call this at startup or between
+// phases that free everything they allocate.
+int
+xmalloc_use(const char* name)
+{
+    pthread_once(&resolve_once, resolve);
+    xmalloc_backend* backend = find_backend(name);
+    if (backend == 0) {
+        return -1;
+    }
+    install(backend);
+    return 0;
+}
+
+const char*
+xmalloc_backend_name()
+{
+    pthread_once(&resolve_once, resolve);
+    return active->name;
+}
+
+static void*
+resolve_malloc(size_t bytes)
+{
+    pthread_once(&resolve_once, resolve);
+    return malloc_fn(bytes);
+}
+
+static void
+resolve_free(void* ptr)
+{
+    pthread_once(&resolve_once, resolve);
+    free_fn(ptr);
+}
+
+static void*
+resolve_realloc(void* prev, size_t bytes)
+{
+    pthread_once(&resolve_once, resolve);
+    return realloc_fn(prev, bytes);
+}
+
+void*
+xmalloc(size_t bytes)
+{
+    return __atomic_load_n(&malloc_fn, __ATOMIC_RELAXED)(bytes);
+}
+
+void
+xfree(void* ptr)
+{
+    __atomic_load_n(&free_fn, __ATOMIC_RELAXED)(ptr);
+}
+
+void*
+xrealloc(void* prev, size_t bytes)
+{
+    return __atomic_load_n(&realloc_fn, __ATOMIC_RELAXED)(prev, bytes);
+}
@@ -7,4 +7,21 @@ void* xmalloc(size_t bytes);
 void  xfree(void* ptr);
 void* xrealloc(void* prev, size_t bytes);
 
+// An allocator that xmalloc can dispatch to. Each one registers itself
+// from a constructor, so linking it in is all it takes to make it
+// available.
+typedef struct xmalloc_backend {
+    const char* name;
+    int         priority; // the highest is used unless one is asked for
+    void*       (*malloc)(size_t bytes);
+    void        (*free)(void* ptr);
+    void*       (*realloc)(void* prev, size_t bytes);
+} xmalloc_backend;
+
+void             xmalloc_register(xmalloc_backend* backend);
+int              xmalloc_use(const char* name);
+const char*      xmalloc_backend_name();
+int              xmalloc_backend_count();
+xmalloc_backend* xmalloc_backend_at(int ii);
+
 #endif
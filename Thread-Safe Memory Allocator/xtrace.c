@@ -0,0 +1,267 @@
+// Allocation trace recorder.
+//
+// Calls are recorded under one lock so that the trace has a single
+// order that every thread agrees on. The recorder keeps its own state
+// in mmapped memory, never in the allocator it is tracing.
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "xtrace.h"
+
+#define XTRACE_BUFFER (64 * 1024)
+
+typedef struct xtrace_slot {
+    void*    ptr;
+    uint32_t id;
+} xtrace_slot;
+
+// Marks a slot whose object was freed, so that probing goes on past
+// it.
+#define XTRACE_GONE ((void*) 1)
+
+static pthread_once_t  xtrace_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t xtrace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int             xtrace_fd = -1;
+static char*           buffer;
+static size_t          buffered = 0;
+static long            last_us = 0;
+static uint32_t        next_id = 0;
+static uint32_t        next_thread = 0;
+static xtrace_slot*    slots;
+static size_t          slots_cap = 0;
+// Slots that are not empty, live or freed, and those of them that are live
+static size_t          slots_used = 0;
+static size_t          slots_live = 0;
+
+static __thread int    xtrace_thread = -1;
+
+static void*
+xtrace_map(size_t size)
+{
+    void* mem = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        abort();
+    }
+    return mem;
+}
+
+static void
+flush_buffer()
+{
+    size_t done = 0;
+    while (done < buffered) {
+        ssize_t rv = write(xtrace_fd, buffer + done, buffered - done);
+        if (rv <= 0) {
+            break;
+        }
+        done += rv;
+    }
+    buffered = 0;
+}
+
+static void
+xtrace_close()
+{
+    pthread_mutex_lock(&xtrace_mutex);
+    flush_buffer();
+    pthread_mutex_unlock(&xtrace_mutex);
+}
+
+static void
+xtrace_open()
+{
+    char* path = getenv("XMALLOC_TRACE");
+    if (path == NULL || path[0] == 0) {
+        return;
+    }
+    xtrace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (xtrace_fd < 0) {
+        return;
+    }
+    buffer = xtrace_map(XTRACE_BUFFER);
+    slots_cap = 1 << 16;
+    slots = xtrace_map(slots_cap * sizeof(xtrace_slot));
+    xtrace_header header = {XTRACE_MAGIC, sizeof(xtrace_record)};
+    memcpy(buffer, &header, sizeof(header));
+    buffered = sizeof(header);
+    atexit(xtrace_close);
+}
+
+int
+xtrace_enabled()
+{
+    pthread_once(&xtrace_once, xtrace_open);
+    return xtrace_fd >= 0;
+}
+
+static long
+now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static size_t
+slot_of(void* ptr)
+{
+    uintptr_t hh = (uintptr_t) ptr;
+    hh ^= hh >> 17;
+    hh *= 0x9e3779b97f4a7c15ULL;
+    return (hh >> 20) & (slots_cap - 1);
+}
+
+static void insert_id(void* ptr, uint32_t id);
+
+// Rebuilds the table once half its slots are not empty. Freed slots are
+// dropped, so the table only doubles if most of those slots are live;
+// otherwise it is rebuilt at the same size.
+static void
+grow_slots()
+{
+    xtrace_slot* old = slots;
+    size_t old_cap = slots_cap;
+    if (2 * slots_live >= slots_used) {
+        slots_cap *= 2;
+    }
+    slots = xtrace_map(slots_cap * sizeof(xtrace_slot));
+    slots_used = 0;
+    slots_live = 0;
+    for (size_t ii = 0; ii < old_cap; ++ii) {
+        if (old[ii].ptr != 0 && old[ii].ptr != XTRACE_GONE) {
+            insert_id(old[ii].ptr, old[ii].id);
+        }
+    }
+    munmap(old, old_cap * sizeof(xtrace_slot));
+}
+
+static void
+insert_id(void* ptr, uint32_t id)
+{
+    if (2 * (slots_used + 1) > slots_cap) {
+        grow_slots();
+    }
+    // A pointer is only live once, so the first freed slot on the way
+    // can take it
+    size_t ii = slot_of(ptr);
+    while (slots[ii].ptr != 0 && slots[ii].ptr != XTRACE_GONE) {
+        ii = (ii + 1) & (slots_cap - 1);
+    }
+    if (slots[ii].ptr == 0) {
+        slots_used += 1;
+    }
+    slots[ii].ptr = ptr;
+    slots[ii].id = id;
+    slots_live += 1;
+}
+
+// Returns the id of a live object and forgets it, or -1 if the
+// pointer was never handed out.
+static long
+remove_id(void* ptr)
+{
+    size_t ii = slot_of(ptr);
+    while (slots[ii].ptr != 0) {
+        if (slots[ii].ptr == ptr) {
+            slots[ii].ptr = XTRACE_GONE;
+            slots_live -= 1;
+            return slots[ii].id;
+        }
+        ii = (ii + 1) & (slots_cap - 1);
+    }
+    return -1;
+}
+
+// Appends a record. Must hold xtrace_mutex.
+static void
+emit(int op, uint32_t id, size_t bytes)
+{
+    if (xtrace_thread < 0) {
+        xtrace_thread = next_thread++;
+    }
+    long us = now_us();
+    xtrace_record rec;
+    rec.op = op;
+    rec.thread = xtrace_thread;
+    rec.delta_us = last_us == 0 ? 0 : (uint32_t) (us - last_us);
+    rec.id = id;
+    rec.size = bytes > UINT32_MAX ? UINT32_MAX : (uint32_t) bytes;
+    last_us = us;
+    if (buffered + sizeof(rec) > XTRACE_BUFFER) {
+        flush_buffer();
+    }
+    memcpy(buffer + buffered, &rec, sizeof(rec));
+    buffered += sizeof(rec);
+}
+
+void
+xtrace_malloc(void* ptr, size_t bytes)
+{
+    if (!xtrace_enabled() || ptr == 0) {
+        return;
+    }
+    pthread_mutex_lock(&xtrace_mutex);
+    uint32_t id = next_id++;
+    insert_id(ptr, id);
+    emit(XTRACE_MALLOC, id, bytes);
+    pthread_mutex_unlock(&xtrace_mutex);
+}
+
+// Called before the object is actually freed, so that no other thread
+// can be handed the same address while it still maps to this object.
+void
+xtrace_free(void* ptr)
+{
+    if (!xtrace_enabled() || ptr == 0) {
+        return;
+    }
+    pthread_mutex_lock(&xtrace_mutex);
+    long id = remove_id(ptr);
+    if (id >= 0) {
+        emit(XTRACE_FREE, (uint32_t) id, 0);
+    }
+    pthread_mutex_unlock(&xtrace_mutex);
+}
+
+// Called before a realloc, like xtrace_free. Returns the object's id,
+// or UINT32_MAX if there is nothing to record.
+uint32_t
+xtrace_realloc_begin(void* prev)
+{
+    if (!xtrace_enabled() || prev == 0) {
+        return UINT32_MAX;
+    }
+    pthread_mutex_lock(&xtrace_mutex);
+    long id = remove_id(prev);
+    pthread_mutex_unlock(&xtrace_mutex);
+    return id < 0 ? UINT32_MAX : (uint32_t) id;
+}
+
+// Called after a realloc with what xtrace_realloc_begin returned. A
+// realloc of nothing is a malloc, and one to zero bytes is a free.
+void
+xtrace_realloc_end(uint32_t id, void* ptr, size_t bytes)
+{
+    if (!xtrace_enabled()) {
+        return;
+    }
+    if (id == UINT32_MAX) {
+        xtrace_malloc(ptr, bytes);
+        return;
+    }
+    pthread_mutex_lock(&xtrace_mutex);
+    if (bytes == 0) {
+        emit(XTRACE_FREE, id, 0);
+    }
+    else {
+        insert_id(ptr, id);
+        emit(XTRACE_REALLOC, id, bytes);
+    }
+    pthread_mutex_unlock(&xtrace_mutex);
+}
@@ -0,0 +1,40 @@
+#ifndef XTRACE_H
+#define XTRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Allocation trace recorder for the xmalloc layer.
+//
+// Setting XMALLOC_TRACE=path makes every xmalloc, xfree and xrealloc
+// append a record to a binary trace at path, which the replay tool
+// runs against any of the allocators.
+
+#define XTRACE_MAGIC 0x31525458 // "XTR1"
+
+#define XTRACE_MALLOC  1
+#define XTRACE_FREE    2
+#define XTRACE_REALLOC 3
+
+// The file starts with a header, followed by one record per call in
+// the order the calls happened.
+typedef struct xtrace_header {
+    uint32_t magic;
+    uint32_t record_size;
+} xtrace_header;
+
+typedef struct xtrace_record {
+    uint32_t op : 8;
+    uint32_t thread : 24;  // numbered from 0 in order of first call
+    uint32_t delta_us; // since the previous record
+    uint32_t id;       // the object, the same for its whole life
+    uint32_t size;
+} xtrace_record;
+
+int      xtrace_enabled();
+void     xtrace_malloc(void* ptr, size_t bytes);
+void     xtrace_free(void* ptr);
+uint32_t xtrace_realloc_begin(void* prev);
+void     xtrace_realloc_end(uint32_t id, void* ptr, size_t bytes);
+
+#endif